@@ -6,7 +6,9 @@
 typedef enum {
   MtdRet_Ok,
   MtdRet_Empty, /* No media */
-  MtdRet_NotImplemented /* API not implemented */
+  MtdRet_NotImplemented, /* API not implemented */
+  MtdRet_Busy, /* No room for the request */
+  MtdRet_Invalid /* Request outside the device or not matching a lock */
 } MtdRet;
 
 typedef enum {
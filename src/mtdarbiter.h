@@ -0,0 +1,169 @@
+#ifndef __MTDARBITER_H
+#define __MTDARBITER_H
+
+#include <Arduino.h>
+#include "mtd.h"
+
+// Number of application requests that can be waiting for the MSC I/O engine
+#ifndef MTD_REQUEST_QUEUE_SIZE
+#define MTD_REQUEST_QUEUE_SIZE 4
+#endif
+
+// One slot stays empty to tell a full queue from an empty one
+#define MTD_REQUEST_QUEUE_SLOTS (MTD_REQUEST_QUEUE_SIZE + 1)
+
+static_assert(MTD_REQUEST_QUEUE_SIZE >= 1 && MTD_REQUEST_QUEUE_SLOTS <= 256,
+              "MTD_REQUEST_QUEUE_SIZE must fit the uint8_t queue indices");
+
+// Number of block ranges the application can hold locked at once
+#ifndef MTD_RANGE_LOCKS
+#define MTD_RANGE_LOCKS 4
+#endif
+
+// Keep the compiler from moving memory accesses across the queue index
+// updates, single core MCUs need nothing more
+#define MTD_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+typedef enum {
+  MtdOp_Read,
+  MtdOp_Write,
+  MtdOp_Lock,  /* Keep the host off the blocks until MtdOp_Unlock */
+  MtdOp_Unlock
+} MtdOp;
+
+/**
+ * \brief A block read/write or range lock from application context.
+ *
+ * The request must stay valid until \ref done is set by the MSC I/O engine.
+ */
+struct MtdRequest
+{
+  MtdOp op;
+  uint32_t start;
+  uint16_t nb_block;            /* At least 1, MtdRet_Invalid otherwise */
+  void *buffer;                 /* nb_block blocks for MtdOp_Read/MtdOp_Write */
+  volatile MtdRet result;
+  volatile bool done;
+};
+
+/**
+ * \brief Lock-free single-producer/single-consumer queue of requests.
+ *
+ * The application pushes, the MSC I/O engine peeks and pops. Each index is
+ * written by one side only and fits in a single byte store.
+ */
+class MtdRequestQueue
+{
+  public:
+    MtdRequestQueue() : head(0), tail(0) {
+    }
+
+    /**
+     * \brief Queue a request, producer side.
+     *
+     * \return false if the queue is full.
+     */
+    bool push(MtdRequest *request) {
+      uint8_t next = (head + 1) % MTD_REQUEST_QUEUE_SLOTS;
+      if(next == tail) {
+        return false;
+      }
+      slots[head] = request;
+      MTD_BARRIER();
+      head = next;
+      return true;
+    }
+
+    /**
+     * \brief Oldest queued request, consumer side.
+     *
+     * \return NULL if the queue is empty.
+     */
+    MtdRequest *peek() {
+      if(tail == head) {
+        return NULL;
+      }
+      MTD_BARRIER();
+      return slots[tail];
+    }
+
+    /**
+     * \brief Drop the request returned by \ref peek(), consumer side.
+     */
+    void pop() {
+      MTD_BARRIER();
+      tail = (tail + 1) % MTD_REQUEST_QUEUE_SLOTS;
+    }
+
+  private:
+    MtdRequest *slots[MTD_REQUEST_QUEUE_SLOTS];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+};
+
+/**
+ * \brief Block ranges locked by the application.
+ *
+ * Only used from the MSC I/O engine, lock requests reach it through the
+ * \ref MtdRequestQueue.
+ */
+class MtdRangeLocks
+{
+  public:
+    MtdRangeLocks() {
+      memset(ranges, 0, sizeof(ranges));
+    }
+
+    /**
+     * \brief Lock a range of blocks.
+     *
+     * \return false if all lock slots are in use.
+     */
+    bool lock(uint32_t start, uint16_t nb_block) {
+      for(int i = 0; i < MTD_RANGE_LOCKS; i++) {
+        if(0 == ranges[i].nb_block) {
+          ranges[i].start = start;
+          ranges[i].nb_block = nb_block;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    /**
+     * \brief Release a range locked by \ref lock() with the same arguments.
+     *
+     * \return false if no such range is locked.
+     */
+    bool unlock(uint32_t start, uint16_t nb_block) {
+      for(int i = 0; i < MTD_RANGE_LOCKS; i++) {
+        if(nb_block == ranges[i].nb_block && start == ranges[i].start) {
+          ranges[i].nb_block = 0;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    /**
+     * \brief Check if any block of a range is locked.
+     */
+    bool conflicts(uint32_t start, uint32_t nb_block) const {
+      for(int i = 0; i < MTD_RANGE_LOCKS; i++) {
+        if(ranges[i].nb_block > 0 &&
+           start < ranges[i].start + ranges[i].nb_block &&
+           ranges[i].start < start + nb_block) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+    struct {
+      uint32_t start;
+      uint16_t nb_block;        /* 0 for a free slot */
+    } ranges[MTD_RANGE_LOCKS];
+};
+
+#endif
@@ -107,5 +107,37 @@
 #define SBC_CMD_DIR_OUT                           (0x00)
 
 
+/****************************************************************************/
+/* Status and sense data                                                    */
+/****************************************************************************/
+
+#define SCSI_STATUS_GOOD                          (0x00)
+#define SCSI_STATUS_CHECK_CONDITION               (0x02)
+#define SCSI_STATUS_TASK_SET_FULL                 (0x28)
+
+#define SCSI_SENSE_NO_SENSE                       (0x00)
+#define SCSI_SENSE_NOT_READY                      (0x02)
+#define SCSI_SENSE_MEDIUM_ERROR                   (0x03)
+#define SCSI_SENSE_ILLEGAL_REQUEST                (0x05)
+#define SCSI_SENSE_UNIT_ATTENTION                 (0x06)
+#define SCSI_SENSE_ABORTED_COMMAND                (0x0B)
+#define SCSI_SENSE_MISCOMPARE                     (0x0E)
+
+// Additional sense code in the high byte, qualifier in the low byte
+#define SCSI_ASC_NO_ADDITIONAL_SENSE_INFO         (0x0000)
+#define SCSI_ASC_WRITE_ERROR                      (0x0C00)
+#define SCSI_ASC_UNRECOVERED_READ_ERROR           (0x1100)
+#define SCSI_ASC_MISCOMPARE_DURING_VERIFY         (0x1D00)
+#define SCSI_ASC_INVALID_COMMAND_OPERATION_CODE   (0x2000)
+#define SCSI_ASC_LBA_OUT_OF_RANGE                 (0x2100)
+#define SCSI_ASC_INVALID_FIELD_IN_CDB             (0x2400)
+#define SCSI_ASC_LOGICAL_UNIT_NOT_SUPPORTED       (0x2500)
+#define SCSI_ASC_MEDIUM_MAY_HAVE_CHANGED          (0x2800)
+#define SCSI_ASC_MEDIUM_NOT_PRESENT               (0x3A00)
+
+// Length of fixed format sense data
+#define SCSI_SENSE_DATA_LENGTH                    (18)
+
+
 
 #endif /* SCSI_COMMANDS_H_ */
@@ -20,6 +20,14 @@
 #define EP_TYPE_BULK_OUT_MSC 		EP_TYPE_BULK_OUT
 #define MSC_BUFFER_SIZE			USB_EP_SIZE
 #define is_write_enabled(x)			(1)
+// Without TRANSFER_RELEASE the core keeps a partial bank until it fills up
+#define USB_SendData(ep, d, len)	USB_Send((ep) | TRANSFER_RELEASE, d, len)
+// The core sends the status stage of a successful control request itself
+#define USB_SendZLP(ep)
+#define USB_WriteEPControl(ep, value)		do { uint8_t sreg = SREG; cli(); uint8_t current = UENUM; \
+									UENUM = (ep) & 7; UECONX = (value); UENUM = current; SREG = sreg; } while(0)
+#define USB_Halt(ep)				USB_WriteEPControl(ep, (1<<STALLRQ) | (1<<EPEN))
+#define USB_ClearHalt(ep)			USB_WriteEPControl(ep, (1<<STALLRQC) | (1<<RSTDT) | (1<<EPEN))
 
 #elif defined(ARDUINO_ARCH_SAM)
 
@@ -42,8 +50,14 @@
 #define USB_Available				USBD_Available
 #define USB_Recv					USBD_Recv
 #define USB_Send					USBD_Send
+#define USB_SendData(ep, d, len)	USB_Send(ep, d, len)
 #define USB_Flush					USBD_Flush
 #define is_write_enabled(x)			Is_udd_write_enabled(x)
+// The core sends the status stage of a successful control request itself
+#define USB_SendZLP(ep)
+#define USB_Halt(ep)				(UOTGHS->UOTGHS_DEVEPTIER[ep] = UOTGHS_DEVEPTIER_STALLRQS)
+#define USB_ClearHalt(ep)			do { UOTGHS->UOTGHS_DEVEPTIDR[ep] = UOTGHS_DEVEPTIDR_STALLRQC; \
+									UOTGHS->UOTGHS_DEVEPTIER[ep] = UOTGHS_DEVEPTIER_RSTDTS; } while(0)
 
 #elif defined(ARDUINO_ARCH_SAMD)
 
@@ -57,11 +71,17 @@
 #define USB_Available				USBDevice.available
 #define USB_Recv					USBDevice.recv
 #define USB_Send					USBDevice.send
+#define USB_SendData(ep, d, len)	USB_Send(ep, d, len)
 #define USB_SendZLP				USBDevice.sendZlp
 #define USB_Flush					USBDevice.flush
 #define USB_Stall					USBDevice.stall
 #define USB_Stall					USBDevice.stall
 #define is_write_enabled(x)			(1)
+#define USB_Halt(ep)				(USB->DEVICE.DeviceEndpoint[ep].EPSTATUSSET.reg = \
+									USB_DEVICE_EPSTATUSSET_STALLRQ0 | USB_DEVICE_EPSTATUSSET_STALLRQ1)
+#define USB_ClearHalt(ep)			(USB->DEVICE.DeviceEndpoint[ep].EPSTATUSCLR.reg = \
+									USB_DEVICE_EPSTATUSCLR_STALLRQ0 | USB_DEVICE_EPSTATUSCLR_STALLRQ1 | \
+									USB_DEVICE_EPSTATUSCLR_DTGLOUT | USB_DEVICE_EPSTATUSCLR_DTGLIN)
 
 #else
 
@@ -87,6 +87,7 @@
 #define  MSC_PROTOCOL_CBI           0x00	//!< Command/Bulk/Interrupt
 #define  MSC_PROTOCOL_CBI_ALT       0x01	//!< W/o command completion
 #define  MSC_PROTOCOL_BULK          0x50	//!< Bulk-only
+#define  MSC_PROTOCOL_UAS           0x62	//!< USB Attached SCSI
 //@}
 
 
@@ -140,6 +141,130 @@ struct usb_msc_csw {
 #define  USB_CSW_STATUS_PE          0x02	//!< Phase Error
 //@}
 
+
+/**
+ * \name USB Attached SCSI (UAS) Pipe Usage descriptor.
+ */
+//@{
+#define  USB_DT_PIPE_USAGE          0x24	//!< bDescriptorType value
+#define  UAS_PIPE_ID_COMMAND        0x01	//!< Command pipe (OUT)
+#define  UAS_PIPE_ID_STATUS         0x02	//!< Status pipe (IN)
+#define  UAS_PIPE_ID_DATA_IN        0x03	//!< Data-in pipe
+#define  UAS_PIPE_ID_DATA_OUT       0x04	//!< Data-out pipe
+//@}
+
+
+/**
+ * \name UAS Information Unit (IU) identifiers.
+ */
+//@{
+#define  UAS_IU_COMMAND             0x01	//!< Command IU
+#define  UAS_IU_SENSE               0x03	//!< Sense IU
+#define  UAS_IU_RESPONSE            0x04	//!< Response IU
+#define  UAS_IU_TASK_MANAGEMENT     0x05	//!< Task Management IU
+#define  UAS_IU_READ_READY          0x06	//!< Read Ready IU
+#define  UAS_IU_WRITE_READY         0x07	//!< Write Ready IU
+//@}
+
+
+/**
+ * \name UAS Command IU, received on the command pipe.
+ */
+//@{
+struct uas_command_iu {
+	uint8_t bIUID;	//!< UAS_IU_COMMAND
+	uint8_t reserved1;
+	be16_t wTag;	//!< Host assigned command tag
+	uint8_t bTaskAttribute;	//!< Priority in bits 6:3, attribute in 2:0
+	uint8_t reserved5;
+	uint8_t bAddCDBLength;	//!< Additional CDB length in bits 7:2
+	uint8_t reserved7;
+	uint8_t LUN[8];	//!< Logical Unit Number
+	uint8_t CDB[16];	//!< SCSI Command Descriptor Block
+};
+
+#define  UAS_TASK_ATTR_MASK         0x07	//!< Valid bits in bTaskAttribute
+#define  UAS_TASK_ATTR_SIMPLE       0x00	//!< May be reordered
+#define  UAS_TASK_ATTR_HEAD         0x01	//!< Head of queue
+#define  UAS_TASK_ATTR_ORDERED      0x02	//!< Ordered
+//@}
+
+
+/**
+ * \name UAS Task Management IU, received on the command pipe.
+ */
+//@{
+struct uas_task_management_iu {
+	uint8_t bIUID;	//!< UAS_IU_TASK_MANAGEMENT
+	uint8_t reserved1;
+	be16_t wTag;	//!< Tag of this task management function
+	uint8_t bFunction;	//!< Task management function
+	uint8_t reserved5;
+	be16_t wTaskTag;	//!< Tag of the command to be managed
+	uint8_t LUN[8];	//!< Logical Unit Number
+};
+
+#define  UAS_TMF_ABORT_TASK         0x01	//!< Abort one command
+#define  UAS_TMF_ABORT_TASK_SET     0x02	//!< Abort all commands
+#define  UAS_TMF_CLEAR_TASK_SET     0x04	//!< Clear all commands
+#define  UAS_TMF_LOGICAL_UNIT_RESET 0x08	//!< Reset the logical unit
+#define  UAS_TMF_IT_NEXUS_RESET     0x10	//!< Reset the I_T nexus
+#define  UAS_TMF_QUERY_TASK         0x80	//!< Is a command still queued
+//@}
+
+
+/**
+ * \name UAS Sense IU, sent on the status pipe to complete a command.
+ */
+//@{
+struct uas_sense_iu {
+	uint8_t bIUID;	//!< UAS_IU_SENSE
+	uint8_t reserved1;
+	be16_t wTag;	//!< Same as the Command IU wTag
+	be16_t wStatusQualifier;
+	uint8_t bStatus;	//!< SCSI status
+	uint8_t reserved7[7];
+	be16_t wLength;	//!< Number of valid bytes in SenseData
+	uint8_t SenseData[18];	//!< Fixed format sense data
+};
+//@}
+
+
+/**
+ * \name UAS Response IU, sent on the status pipe for task management
+ * and IU errors.
+ */
+//@{
+struct uas_response_iu {
+	uint8_t bIUID;	//!< UAS_IU_RESPONSE
+	uint8_t reserved1;
+	be16_t wTag;	//!< Tag of the IU being answered
+	uint8_t AddResponseInfo[3];
+	uint8_t bResponseCode;	//!< Response code
+};
+
+#define  UAS_RC_TMF_COMPLETE        0x00	//!< Function complete
+#define  UAS_RC_INVALID_IU          0x02	//!< Invalid information unit
+#define  UAS_RC_TMF_NOT_SUPPORTED   0x04	//!< Function not supported
+#define  UAS_RC_TMF_FAILED          0x05	//!< Function failed
+#define  UAS_RC_TMF_SUCCEEDED       0x08	//!< Function succeeded
+#define  UAS_RC_INCORRECT_LUN       0x09	//!< Incorrect LUN
+#define  UAS_RC_OVERLAPPED_TAG      0x0A	//!< Overlapped tag attempted
+//@}
+
+
+/**
+ * \name UAS Read Ready / Write Ready IU, sent on the status pipe before
+ * the data phase of a command.
+ */
+//@{
+struct uas_ready_iu {
+	uint8_t bIUID;	//!< UAS_IU_READ_READY or UAS_IU_WRITE_READY
+	uint8_t reserved1;
+	be16_t wTag;	//!< Tag of the command whose data is ready
+};
+//@}
+
 COMPILER_PACK_RESET()
 
 //@}
@@ -27,6 +27,7 @@ typedef uint32_t                le32_t;
 typedef uint32_t                be32_t;
 
 #include "usb_protocol_msc.h"
+#include "scsi_commands.h"
 
 // Endpoint number of the Mass Storage device-to-host data IN endpoint.
 #define MASS_STORAGE_IN_EPNUM          3	
@@ -42,40 +43,249 @@ typedef uint32_t                be32_t;
 #define MSC_RX MSC_ENDPOINT_OUT
 #define MSC_TX MSC_ENDPOINT_IN
 
-#define MSC_CLASS 0x8
-
 #define OUT_BANK                           0
 #define IN_BANK                            1
 
 #define COMPILER_WORD_ALIGNED         __attribute__((__aligned__(4)))
 
-//	DEVICE DESCRIPTOR
-//const DeviceDescriptor USB_DeviceDescriptorB = D_DEVICE(0xEF, 0x02, 0x01, 64, USB_VID, USB_PID, 0x100, IMANUFACTURER, IPRODUCT, ISERIAL, 1);
-//const DeviceDescriptor USB_DeviceDescriptor = D_DEVICE(0x00, 0x00, 0x00, 64, USB_VID, USB_PID, 0x100, IMANUFACTURER, IPRODUCT, ISERIAL, 1);
-//const	DeviceDescriptor USB_DeviceDescriptor = D_DEVICE(0x00, 0x00, 0x00, 0x40, 0x03EB, 0x2403, 0x100, 0x00, 0x20, 0x03, 0x1);
-const DeviceDescriptor USB_DeviceDescriptorB = D_DEVICE(0xEF, 0x02, 0x01, MSC_MAX_EP_SIZE, USB_VID, USB_PID, 0x100, IMANUFACTURER, IPRODUCT, ISERIAL, 1);
-const	DeviceDescriptor USB_DeviceDescriptor = D_DEVICE(0x00, 0x00, 0x00, MSC_MAX_EP_SIZE, USB_VID, USB_PID, 0x100, IMANUFACTURER, IPRODUCT, ISERIAL, 1);
+// Direction of the open Mtd transfer
+#define MSC_MTD_IDLE                       0
+#define MSC_MTD_READ                       1
+#define MSC_MTD_WRITE                      2
+
+#define MSC_CRC_INIT                       0xFFFFFFFF
+
+static_assert(MSC_LUN_COUNT == 1, "Only a single Mtd backed LUN is supported");
+static_assert(MSC_BULK_IN_EP_SIZE <= 0x7FF && MSC_BULK_OUT_EP_SIZE <= 0x7FF, "Invalid bulk endpoint size");
+
+//	INTERFACE DESCRIPTOR
+//	Interface 0 and endpoints from 0, getInterface() adds the numbers PluggableUSB assigned
+#if MSC_UAS
+static const MSCDescriptor mscInterface PROGMEM =
+{
+	D_INTERFACE(0, 4, MSC_CLASS, MSC_SUBCLASS_TRANSPARENT, MSC_PROTOCOL_UAS),
+	D_MSC_EP(MSC_UAS_CMD_EP_OFFSET, MSC_BULK_OUT_EP_SIZE),
+	D_PIPE_USAGE(UAS_PIPE_ID_COMMAND),
+	D_MSC_EP(MSC_UAS_STATUS_EP_OFFSET | 0x80, MSC_BULK_IN_EP_SIZE),
+	D_PIPE_USAGE(UAS_PIPE_ID_STATUS),
+	D_MSC_EP(MSC_DATA_IN_EP_OFFSET | 0x80, MSC_BULK_IN_EP_SIZE),
+	D_PIPE_USAGE(UAS_PIPE_ID_DATA_IN),
+	D_MSC_EP(MSC_DATA_OUT_EP_OFFSET, MSC_BULK_OUT_EP_SIZE),
+	D_PIPE_USAGE(UAS_PIPE_ID_DATA_OUT)
+};
+#else
+static const MSCDescriptor mscInterface PROGMEM =
+{
+	D_INTERFACE(0, 2, MSC_CLASS, MSC_SUBCLASS_TRANSPARENT, MSC_PROTOCOL_BULK),
+	D_MSC_EP(MSC_BULK_IN_EP_OFFSET | 0x80, MSC_BULK_IN_EP_SIZE),
+	D_MSC_EP(MSC_BULK_OUT_EP_OFFSET, MSC_BULK_OUT_EP_SIZE)
+};
+
+// Get Max LUN answer, the highest LUN number
+static const uint8_t maxLun PROGMEM = MSC_LUN_COUNT - 1;
+#endif
 
 MSC_ MassStorage;
 
 COMPILER_WORD_ALIGNED
-uint8_t getmaxlun[] = {
-	0x00,	 // 0 (since one LUN (SD card) is connected )
+static uint8_t blockBuffer[MSC_BLOCK_SIZE];
+
+static const uint8_t inquiryData[] = {
+	0x00,	// Direct access block device
+	0x80,	// Removable medium
+	0x04,	// SPC-2
+	0x02,	// Response data format
+	31,	// Additional length
+	0x00, 0x00, 0x00,
+	'A', 'r', 'd', 'u', 'i', 'n', 'o', ' ',	// Vendor
+	'M', 'a', 's', 's', ' ', 'S', 't', 'o', 'r', 'a', 'g', 'e', ' ', ' ', ' ', ' ',	// Product
+	'1', '.', '0', '0'	// Revision
+};
+
+static uint16_t getBE16(const uint8_t *p)
+{
+	return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static uint32_t getBE32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void putBE32(uint8_t *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+// Commands that address a range of blocks
+static bool isBlockCommand(uint8_t opcode)
+{
+	return SBC_CMD_READ_10 == opcode || SBC_CMD_WRITE_10 == opcode ||
+		SBC_CMD_VERIFY_10 == opcode || SBC_CMD_WRITE_VERIFY_10 == opcode;
+}
+
+// CRC-32 (IEEE 802.3, reflected) lookup table
+static const uint32_t crcTable[256] PROGMEM = {
+	0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA,
+	0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
+	0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+	0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
+	0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE,
+	0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+	0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
+	0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
+	0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+	0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
+	0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940,
+	0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+	0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116,
+	0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
+	0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+	0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
+	0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A,
+	0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+	0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818,
+	0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
+	0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+	0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
+	0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C,
+	0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+	0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2,
+	0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
+	0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+	0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
+	0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086,
+	0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+	0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4,
+	0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
+	0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+	0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
+	0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8,
+	0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+	0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE,
+	0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
+	0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+	0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
+	0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252,
+	0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+	0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60,
+	0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
+	0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+	0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
+	0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04,
+	0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+	0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A,
+	0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
+	0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+	0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
+	0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E,
+	0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+	0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C,
+	0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
+	0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+	0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
+	0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0,
+	0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+	0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6,
+	0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
+	0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+	0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
 };
 
+static uint32_t crc32Software(uint32_t crc, const uint8_t *data, uint32_t length)
+{
+	while(length-- > 0) {
+		crc = pgm_read_dword(&crcTable[(crc ^ *data++) & 0xFF]) ^ (crc >> 8);
+	}
+	return crc;
+}
+
+// The DSU CRC below is written for the SAMD21, SAMD51 parts have no PAC1
+// and a different write protection scheme so they use the table
+#if defined(ARDUINO_ARCH_SAMD) && defined(PAC1) && !defined(MSC_CRC_SOFTWARE)
+
+// The Device Service Unit computes CRC-32 over word aligned RAM. It is not
+// available on protected devices, so a test run decides once whether to use
+// it, and only if it agrees with the table so either can finish a CRC the
+// other started.
+static bool crc32Hardware(uint32_t *crc, const void *data, uint32_t length)
+{
+	PAC1->WPCLR.reg = 1 << 1;	// DSU is peripheral 1 on APBB
+	DSU->STATUSA.reg = DSU_STATUSA_DONE | DSU_STATUSA_BERR;
+	DSU->DATA.reg = *crc;
+	DSU->ADDR.reg = (uint32_t)data;
+	DSU->LENGTH.reg = length;
+	DSU->CTRL.reg = DSU_CTRL_CRC;
+	while(!DSU->STATUSA.bit.DONE) {
+	}
+	if(DSU->STATUSA.bit.BERR) {
+		return false;
+	}
+	*crc = DSU->DATA.reg;
+	return true;
+}
+
+// Continue a CRC-32 over the block buffer
+static uint32_t crcBlock(uint32_t crc)
+{
+	static int8_t useHardware = -1;
+	if(useHardware < 0) {
+		uint32_t test = MSC_CRC_INIT;
+		useHardware = crc32Hardware(&test, blockBuffer, sizeof(uint32_t)) &&
+			crc32Software(MSC_CRC_INIT, blockBuffer, sizeof(uint32_t)) == test ? 1 : 0;
+	}
+	if(useHardware) {
+		if(crc32Hardware(&crc, blockBuffer, sizeof(blockBuffer))) {
+			return crc;
+		}
+		// A bus error leaves the CRC as it was, the table takes over from there
+		useHardware = 0;
+	}
+	return crc32Software(crc, blockBuffer, sizeof(blockBuffer));
+}
+
+#else
+
+// Continue a CRC-32 over the block buffer
+static uint32_t crcBlock(uint32_t crc)
+{
+	return crc32Software(crc, blockBuffer, sizeof(blockBuffer));
+}
+
+#endif
+
 int MSC_::getInterface(uint8_t* interfaceNum)
 {
 	DBUG("getInterface: ");
 	DBUGLN(*interfaceNum);
 
 	interfaceNum[0] += 1;	// uses 1 interfaces
-	MSCDescriptor _mscInterface =
+
+	// Send one descriptor at a time from flash, only the one being patched is copied to RAM
+	const uint8_t *desc = (const uint8_t *)&mscInterface;
+	int sent = 0;
+	for(uint8_t offset = 0; offset < sizeof(mscInterface); )
 	{
-		D_INTERFACE(MSC_INTERFACE, 2, MSC_CLASS, MSC_SUBCLASS_SCSI, MSC_PROTOCOL_BULK_ONLY),
-		D_MSC_EP(MSC_BULK_IN_EP | 0x80, MSC_BULK_IN_EP_SIZE),
-		D_MSC_EP(MSC_BULK_OUT_EP, MSC_BULK_OUT_EP_SIZE)
-	};
-	return USB_SendControl(0, &_mscInterface, sizeof(_mscInterface));
+		uint8_t buffer[sizeof(InterfaceDescriptor)];
+		uint8_t length = pgm_read_byte(desc + offset);
+		memcpy_P(buffer, desc + offset, length);
+		if(USB_INTERFACE_DESCRIPTOR_TYPE == buffer[1]) {
+			buffer[2] += MSC_INTERFACE;
+		} else if(USB_ENDPOINT_DESCRIPTOR_TYPE == buffer[1]) {
+			buffer[2] += MSC_FIRST_ENDPOINT;
+		}
+
+		int ret = USB_SendControl(0, buffer, length);
+		if(ret < 0) {
+			return ret;
+		}
+		sent += ret;
+		offset += length;
+	}
+	return sent;
 }
 
 bool MSC_::setup(USBSetup& setup)
@@ -83,66 +293,70 @@ bool MSC_::setup(USBSetup& setup)
 	DBUG("setup: ");
 	DBUG(setup.bmRequestType, HEX);
 	DBUG(" ");
-	DBUG(setup.wValueH, HEX);
+	DBUG(setup.bRequest, HEX);
 	DBUG(" ");
 	DBUG(setup.wIndex, HEX);
 	DBUG(" ");
 	DBUGLN(setup.wLength, HEX);
 
-	switch(setup.bmRequestType) 
+	// Returning false makes the core stall the control endpoint
+	if (setup.wIndex != MSC_INTERFACE || setup.wValueL != 0 || setup.wValueH != 0) {
+		return false;
+	}
+
+#if MSC_UAS
+	// UAS has no class specific requests
+	return false;
+#else
+	switch(setup.bRequest)
 	{
 		// MSC class requests
 		// Get MaxLUN supported
-		case GET_MAX_LUN:
+		case USB_REQ_MSC_GET_MAX_LUN:
 			DBUGLN("GET_MAX_LUN");
-			// wIndex should be interface number
-			if (setup.wValueH == 0 /* && setup.wIndex == 0 */ && setup.wLength == 1) {
-				USB_Send(CTRL_EP, getmaxlun, sizeof(getmaxlun));
-			} else {
-				//  Stall the request
-				USB_Stall(IN_BANK);
+			if (setup.bmRequestType != REQUEST_DEVICETOHOST_CLASS_INTERFACE || setup.wLength != 1) {
+				return false;
 			}
+			USB_SendControl(TRANSFER_PGM, &maxLun, sizeof(maxLun));
+			// Hosts ask once the device is configured, which is also how a
+			// port reset ends when the host gave up on reset recovery. The core
+			// has set up the endpoints again, drop whatever BOT state is left.
+			botHalted = false;
+			resetPending = true;
 			return true;
 
-		case MASS_STORAGE_RESET:
+		case USB_REQ_MSC_BULK_RESET:
 			DBUGLN("MASS_STORAGE_RESET");
-			// wIndex should be interface number
-			//dir = setup.wIndex & 0x80;
-			if (setup.wValueH == 0 && setup.wIndex == 0 && setup.wLength == 0) {
-				//epSetStatusReg(MSC_BULK_IN_EP, USB_DEVICE_EPSTATUSSET_DTGLIN);
-				//epSetStatusReg(MSC_BULK_OUT_EP, USB_DEVICE_EPSTATUSSET_DTGLOUT);
-				USB_SendZLP(CTRL_EP);
-			} else {
-				//  Stall the request
-				USB_Stall(IN_BANK);
+			if (setup.bmRequestType != REQUEST_HOSTTODEVICE_CLASS_INTERFACE || setup.wLength != 0) {
+				return false;
 			}
+			// The host follows up with Clear Feature HALT on both bulk endpoints,
+			// which the core acknowledges without touching the endpoint, so the
+			// stall and data toggles are cleared here for both sides to agree.
+			// Any Mtd transfer in flight is aborted by poll().
+			USB_ClearHalt(MSC_BULK_IN_EP);
+			USB_ClearHalt(MSC_BULK_OUT_EP);
+			botHalted = false;
+			resetPending = true;
+			USB_SendZLP(CTRL_EP);
 			return true;
 	}
 
 	return false;
+#endif
 }
 
 int MSC_::getDescriptor(USBSetup& setup)
 {
+	(void)setup;
 	DBUG("getDescriptor ");
 	DBUG(setup.bmRequestType, HEX);
 	DBUG(" ");
 	DBUGLN(setup.wValueH, HEX);
 
-	// Check if this is a HID Class Descriptor request
-	if (setup.bmRequestType != REQUEST_DEVICETOHOST_STANDARD_INTERFACE) { return 0; }
-	if (setup.wValueH != 0x100) { return 0; }
-
-	uint8_t desc_length = 0;
-	const uint8_t *desc_addr = 0;
-
-	desc_addr = (const uint8_t*)&(8 == setup.wLength ? USB_DeviceDescriptorB : USB_DeviceDescriptor);
-	desc_length = *desc_addr;
-	if (desc_length > setup.wLength) {
-		desc_length = setup.wLength;
-	}
-
-	return USB_SendControl(0, desc_addr, desc_length);
+	// The device and configuration descriptors come from the core, which
+	// already picks the composite device class when CDC is enabled
+	return 0;
 }
 
 uint8_t MSC_::getShortName(char* name)
@@ -153,25 +367,938 @@ uint8_t MSC_::getShortName(char* name)
 
 void MSC_::handleEndpoint(uint8_t ep)
 {
+	(void)ep;
 	DBUG("handleEndpoint ");
 	DBUGLN(ep, HEX);
+}
 
+void MSC_::setSense(uint8_t key, uint16_t code)
+{
+	senseKey = key;
+	senseCode = code;
+}
+
+uint8_t MSC_::takeSense(uint8_t *buffer)
+{
+	memset(buffer, 0, SCSI_SENSE_DATA_LENGTH);
+	buffer[0] = 0x70;	// Current error, fixed format
+	buffer[2] = senseKey;
+	buffer[7] = SCSI_SENSE_DATA_LENGTH - 8;	// Additional sense length
+	buffer[12] = senseCode >> 8;
+	buffer[13] = senseCode & 0xFF;
+	setSense(SCSI_SENSE_NO_SENSE, SCSI_ASC_NO_ADDITIONAL_SENSE_INFO);
+	return SCSI_SENSE_DATA_LENGTH;
+}
+
+bool MSC_::dataPhase(bool in, uint32_t length)
+{
+#if MSC_UAS
+	if(length > 0) {
+		uasSendReady(in ? UAS_IU_READ_READY : UAS_IU_WRITE_READY);
+	}
+	return true;
+#else
+	// Cases 2, 3, 7, 8, 10 and 13: the host expects no data, data in the other
+	// direction or less than the device intends to move, nothing is moved and
+	// the CSW reports a phase error
+	if(length > 0 && (0 == dataLength || in != dataIn || length > dataLength)) {
+		DBUGLN("dataPhase: phase error");
+		phaseError = true;
+		return false;
+	}
+	return true;
+#endif
+}
+
+bool MSC_::sendResponse(const void *data, uint32_t length)
+{
+	return dataPhase(true, length) && sendData(data, length);
+}
+
+bool MSC_::sendData(const void *data, uint32_t length)
+{
+	if(length > dataLength - dataDone) {
+		length = dataLength - dataDone;
+	}
+	if(0 == length) {
+		return true;
+	}
+	if(resetPending) {
+		return false;
+	}
+	if((uint32_t)USB_SendData(MSC_DATA_IN_EP, data, length) != length) {
+		return false;
+	}
+	dataDone += length;
+	return true;
+}
+
+bool MSC_::recvData(void *data, uint32_t length)
+{
+	if(length > dataLength - dataDone) {
+		return false;
+	}
+	uint8_t *dest = (uint8_t *)data;
+	uint32_t got = 0;
+	while(got < length) {
+		int recv = (int)USB_Recv(MSC_DATA_OUT_EP, dest + got, length - got);
+		if(recv < 0 || resetPending) {
+			return false;
+		}
+		got += recv;
+	}
+	dataDone += length;
+	return true;
+}
+
+void MSC_::mtdClose()
+{
+	if(mtdLeft > 0) {
+		if(MSC_MTD_READ == mtdOp) {
+			mtd.waitEndOfReadBlocks(true);
+		} else {
+			mtd.waitEndOfWriteBlocks(true);
+		}
+	}
+	mtdOp = MSC_MTD_IDLE;
+	mtdLeft = 0;
+}
+
+bool MSC_::mtdOpen(uint8_t op, uint32_t lba, uint16_t count)
+{
+	if(op == mtdOp && lba == mtdLba && count <= mtdLeft) {
+		// Carry on with a transfer merged ahead of time
+		return true;
+	}
+	mtdClose();
+
+	uint32_t total = (uint32_t)count + mergeAhead(op, lba + count);
+	if(total > 0xFFFF) {
+		total = 0xFFFF;
+	}
+
+	MtdRet ret = MSC_MTD_READ == op ?
+		mtd.initReadBlocks(lba, total) :
+		mtd.initWriteBlocks(lba, total);
+	if(MtdRet_Ok != ret) {
+		if(MtdRet_Empty == ret) {
+			setSense(SCSI_SENSE_NOT_READY, SCSI_ASC_MEDIUM_NOT_PRESENT);
+		} else {
+			setSense(SCSI_SENSE_MEDIUM_ERROR, MSC_MTD_READ == op ?
+				SCSI_ASC_UNRECOVERED_READ_ERROR : SCSI_ASC_WRITE_ERROR);
+		}
+		return false;
+	}
+
+	mtdOp = op;
+	mtdLba = lba;
+	mtdLeft = total;
+	return true;
+}
+
+bool MSC_::readBlocks(uint32_t lba, uint16_t count)
+{
+	if(!mtdOpen(MSC_MTD_READ, lba, count)) {
+		return false;
+	}
+
+	while(count-- > 0)
+	{
+		if(MtdRet_Ok != mtd.startReadBlocks(blockBuffer, 1) ||
+			 MtdRet_Ok != mtd.waitEndOfReadBlocks(false))
+		{
+			mtdClose();
+			setSense(SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_UNRECOVERED_READ_ERROR);
+			return false;
+		}
+		mtdLba++;
+		mtdLeft--;
+
+		// A reset recovery aborts the transfer rather than waiting for the host to time out
+		if(!sendData(blockBuffer, MSC_BLOCK_SIZE)) {
+			mtdClose();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool MSC_::writeBlocks(uint32_t lba, uint16_t count, uint32_t *crc)
+{
+	if(!mtdOpen(MSC_MTD_WRITE, lba, count)) {
+		return false;
+	}
+
+	while(count-- > 0)
+	{
+		if(!recvData(blockBuffer, MSC_BLOCK_SIZE)) {
+			mtdClose();
+			return false;
+		}
+		if(crc) {
+			*crc = crcBlock(*crc);
+		}
+
+		if(MtdRet_Ok != mtd.startWriteBlocks(blockBuffer, 1) ||
+			 MtdRet_Ok != mtd.waitEndOfWriteBlocks(false))
+		{
+			mtdClose();
+			setSense(SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_WRITE_ERROR);
+			return false;
+		}
+		mtdLba++;
+		mtdLeft--;
+	}
+
+	return true;
+}
+
+bool MSC_::verifyBlocks(uint32_t lba, uint16_t count, uint32_t *crc)
+{
+	if(!mtdOpen(MSC_MTD_READ, lba, count)) {
+		return false;
+	}
+
+	while(count-- > 0)
+	{
+		if(resetPending) {
+			mtdClose();
+			return false;
+		}
+
+		if(MtdRet_Ok != mtd.startReadBlocks(blockBuffer, 1) ||
+			 MtdRet_Ok != mtd.waitEndOfReadBlocks(false))
+		{
+			mtdClose();
+			setSense(SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_UNRECOVERED_READ_ERROR);
+			return false;
+		}
+		mtdLba++;
+		mtdLeft--;
+
+		if(crc) {
+			*crc = crcBlock(*crc);
+		}
+	}
+
+	return true;
+}
+
+uint8_t MSC_::verifyCommand(const uint8_t *cdb, uint32_t lba, uint16_t count)
+{
+	// BYTCHK 0 only checks the blocks can be read, 1 compares them with data from the host
+	uint8_t bytchk = (cdb[1] >> 1) & 0x03;
+	bool write = SBC_CMD_WRITE_VERIFY_10 == cdb[0];
+	if(!write && bytchk > 1) {
+		setSense(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD_IN_CDB);
+		return SCSI_STATUS_CHECK_CONDITION;
+	}
+
+	bool compare = write || bytchk;
+	if(compare && !dataPhase(false, (uint32_t)count * MSC_BLOCK_SIZE)) {
+		return SCSI_STATUS_CHECK_CONDITION;
+	}
+
+	// Host data is reduced to a CRC as it streams in, then the blocks are read
+	// back through the Mtd and their CRC compared, so only one block is held
+	uint32_t expected = MSC_CRC_INIT;
+	if(write) {
+		if(!writeBlocks(lba, count, &expected)) {
+			return SCSI_STATUS_CHECK_CONDITION;
+		}
+	} else if(compare) {
+		for(uint16_t i = 0; i < count; i++) {
+			if(!recvData(blockBuffer, MSC_BLOCK_SIZE)) {
+				return SCSI_STATUS_CHECK_CONDITION;
+			}
+			expected = crcBlock(expected);
+		}
+	}
+
+	uint32_t actual = MSC_CRC_INIT;
+	if(!verifyBlocks(lba, count, compare ? &actual : NULL)) {
+		return SCSI_STATUS_CHECK_CONDITION;
+	}
+	if(compare && actual != expected) {
+		setSense(SCSI_SENSE_MISCOMPARE, SCSI_ASC_MISCOMPARE_DURING_VERIFY);
+		return SCSI_STATUS_CHECK_CONDITION;
+	}
+	return SCSI_STATUS_GOOD;
+}
+
+uint16_t MSC_::mergeAhead(uint8_t op, uint32_t lba)
+{
+	uint32_t blocks = 0;
+
+#if MSC_UAS
+	// Follow the chain of queued requests that start where the previous one ends
+	uint8_t opcode = MSC_MTD_READ == op ? SBC_CMD_READ_10 : SBC_CMD_WRITE_10;
+	bool found = true;
+	while(found && blocks < 0xFFFF)
+	{
+		found = false;
+		for(int i = 0; i < MSC_UAS_QUEUE_DEPTH; i++)
+		{
+			MSCUasCommand &cmd = uasQueue[i];
+			if(cmd.used && opcode == cmd.cdb[0] && lba == cmd.lba && cmd.blocks > 0)
+			{
+				blocks += cmd.blocks;
+				lba += cmd.blocks;
+				found = true;
+			}
+		}
+	}
+#else
+	(void)op;
+	(void)lba;
+#endif
+
+	return blocks > 0xFFFF ? 0xFFFF : blocks;
+}
+
+uint8_t MSC_::scsiCommand(const uint8_t *cdb)
+{
+	DBUG("scsiCommand: ");
+	DBUGLN(cdb[0], HEX);
+
+	// The data phases move MSC_BLOCK_SIZE blocks, a medium with another block
+	// size is reported as not ready rather than with a wrong capacity
+	bool ready = MtdState_Ready == mtd.getState() && MSC_BLOCK_SIZE == mtd.getBlockSize();
+
+	// The application wrote to the medium behind the host's back, report it
+	// once as a UNIT ATTENTION so the host drops what it has cached. INQUIRY
+	// is answered as usual and REQUEST SENSE returns the UNIT ATTENTION.
+	if(mediumChanged && SBC_CMD_INQUIRY != cdb[0]) {
+		mediumChanged = false;
+		setSense(SCSI_SENSE_UNIT_ATTENTION, SCSI_ASC_MEDIUM_MAY_HAVE_CHANGED);
+		if(SBC_CMD_REQUEST_SENSE != cdb[0]) {
+			return SCSI_STATUS_CHECK_CONDITION;
+		}
+	}
+
+	switch(cdb[0])
+	{
+		case SBC_CMD_TEST_UNIT_READY:
+			break;
+
+		case SBC_CMD_REQUEST_SENSE:
+		{
+			uint8_t sense[SCSI_SENSE_DATA_LENGTH];
+			uint8_t length = takeSense(sense);
+			sendResponse(sense, min(length, cdb[4]));
+			return SCSI_STATUS_GOOD;
+		}
+
+		case SBC_CMD_INQUIRY:
+			if(cdb[1] & 0x01) {
+				// No vital product data pages
+				setSense(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD_IN_CDB);
+				return SCSI_STATUS_CHECK_CONDITION;
+			}
+			sendResponse(inquiryData, min((uint16_t)sizeof(inquiryData), getBE16(cdb + 3)));
+			return SCSI_STATUS_GOOD;
+
+		case SBC_CMD_MODE_SENSE_6:
+		{
+			uint8_t header[4] = { 3, 0, 0, 0 };
+			sendResponse(header, min((uint8_t)sizeof(header), cdb[4]));
+			return SCSI_STATUS_GOOD;
+		}
+
+		case SBC_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+		case SBC_CMD_START_STOP_UNIT:
+			return SCSI_STATUS_GOOD;
+
+		case SBC_CMD_READ_CAPACITY_10:
+		{
+			if(!ready) {
+				break;
+			}
+			uint8_t capacity[8];
+			putBE32(capacity, mtd.getCapacity() - 1);
+			putBE32(capacity + 4, MSC_BLOCK_SIZE);
+			sendResponse(capacity, sizeof(capacity));
+			return SCSI_STATUS_GOOD;
+		}
+
+		case SBC_CMD_READ_10:
+		case SBC_CMD_WRITE_10:
+		case SBC_CMD_VERIFY_10:
+		case SBC_CMD_WRITE_VERIFY_10:
+		{
+			if(!ready) {
+				break;
+			}
+			uint32_t lba = getBE32(cdb + 2);
+			uint16_t count = getBE16(cdb + 7);
+			if(lba > mtd.getCapacity() || count > mtd.getCapacity() - lba) {
+				setSense(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_LBA_OUT_OF_RANGE);
+				return SCSI_STATUS_CHECK_CONDITION;
+			}
+			if(0 == count) {
+				// A transfer length of 0 moves no blocks, the Mtd is not involved
+				return SCSI_STATUS_GOOD;
+			}
+			if(SBC_CMD_VERIFY_10 == cdb[0] || SBC_CMD_WRITE_VERIFY_10 == cdb[0]) {
+				return verifyCommand(cdb, lba, count);
+			}
+			bool read = SBC_CMD_READ_10 == cdb[0];
+			if(!dataPhase(read, (uint32_t)count * MSC_BLOCK_SIZE)) {
+				return SCSI_STATUS_CHECK_CONDITION;
+			}
+			bool ok = read ?
+				readBlocks(lba, count) :
+				writeBlocks(lba, count);
+			return ok ? SCSI_STATUS_GOOD : SCSI_STATUS_CHECK_CONDITION;
+		}
+
+		default:
+			setSense(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_COMMAND_OPERATION_CODE);
+			return SCSI_STATUS_CHECK_CONDITION;
+	}
+
+	if(!ready) {
+		setSense(SCSI_SENSE_NOT_READY, SCSI_ASC_MEDIUM_NOT_PRESENT);
+		return SCSI_STATUS_CHECK_CONDITION;
+	}
+	return SCSI_STATUS_GOOD;
+}
+
+#if MSC_UAS
+
+static void putBE16(uint8_t *p, uint16_t value)
+{
+	p[0] = value >> 8;
+	p[1] = value;
+}
+
+void MSC_::uasSendReady(uint8_t iuId)
+{
+	struct uas_ready_iu iu = { iuId, 0, 0 };
+	putBE16((uint8_t *)&iu.wTag, uasTag);
+	USB_SendData(MSC_UAS_STATUS_EP, &iu, sizeof(iu));
+}
+
+void MSC_::uasSendSense(uint16_t tag, uint8_t status)
+{
+	struct uas_sense_iu iu;
+	memset(&iu, 0, sizeof(iu));
+	iu.bIUID = UAS_IU_SENSE;
+	putBE16((uint8_t *)&iu.wTag, tag);
+	iu.bStatus = status;
+
+	uint16_t length = 0;
+	if(SCSI_STATUS_CHECK_CONDITION == status) {
+		length = takeSense(iu.SenseData);
+	}
+	putBE16((uint8_t *)&iu.wLength, length);
+
+	USB_SendData(MSC_UAS_STATUS_EP, &iu, sizeof(iu) - sizeof(iu.SenseData) + length);
+}
+
+void MSC_::uasSendResponse(uint16_t tag, uint8_t code)
+{
+	struct uas_response_iu iu;
+	memset(&iu, 0, sizeof(iu));
+	iu.bIUID = UAS_IU_RESPONSE;
+	putBE16((uint8_t *)&iu.wTag, tag);
+	iu.bResponseCode = code;
+	USB_SendData(MSC_UAS_STATUS_EP, &iu, sizeof(iu));
+}
+
+static bool uasLunZero(const uint8_t *lun)
+{
+	for(int i = 0; i < 8; i++) {
+		if(lun[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void MSC_::uasQueueCommand(const void *data)
+{
+	const struct uas_command_iu *iu = (const struct uas_command_iu *)data;
+	uint16_t tag = getBE16((const uint8_t *)&iu->wTag);
+
+	if(!uasLunZero(iu->LUN)) {
+		uasSendResponse(tag, UAS_RC_INCORRECT_LUN);
+		return;
+	}
+
+	int free = -1;
+	for(int i = 0; i < MSC_UAS_QUEUE_DEPTH; i++)
+	{
+		if(!uasQueue[i].used) {
+			free = i;
+		} else if(tag == uasQueue[i].tag) {
+			uasSendResponse(tag, UAS_RC_OVERLAPPED_TAG);
+			return;
+		}
+	}
+
+	if(free < 0) {
+		uasSendSense(tag, SCSI_STATUS_TASK_SET_FULL);
+		return;
+	}
+
+	MSCUasCommand &cmd = uasQueue[free];
+	cmd.used = true;
+	cmd.tag = tag;
+	memcpy(cmd.cdb, iu->CDB, sizeof(cmd.cdb));
+	cmd.attribute = iu->bTaskAttribute & UAS_TASK_ATTR_MASK;
+	if(UAS_TASK_ATTR_SIMPLE != cmd.attribute && UAS_TASK_ATTR_HEAD != cmd.attribute) {
+		cmd.attribute = UAS_TASK_ATTR_ORDERED;
+	}
+	cmd.sequence = uasSequence++;
+	cmd.overtaken = 0;
+	if(isBlockCommand(cmd.cdb[0])) {
+		cmd.lba = getBE32(cmd.cdb + 2);
+		cmd.blocks = getBE16(cmd.cdb + 7);
+	} else {
+		cmd.lba = 0;
+		cmd.blocks = 0;
+	}
+}
+
+void MSC_::uasTaskManagement(const void *data)
+{
+	const struct uas_task_management_iu *iu = (const struct uas_task_management_iu *)data;
+	uint16_t tag = getBE16((const uint8_t *)&iu->wTag);
+	uint16_t taskTag = getBE16((const uint8_t *)&iu->wTaskTag);
+
+	if(!uasLunZero(iu->LUN)) {
+		uasSendResponse(tag, UAS_RC_INCORRECT_LUN);
+		return;
+	}
+
+	switch(iu->bFunction)
+	{
+		case UAS_TMF_ABORT_TASK:
+			// Commands run to completion inside poll(), so only queued ones can be aborted
+			for(int i = 0; i < MSC_UAS_QUEUE_DEPTH; i++) {
+				if(uasQueue[i].used && taskTag == uasQueue[i].tag) {
+					uasQueue[i].used = false;
+				}
+			}
+			uasSendResponse(tag, UAS_RC_TMF_COMPLETE);
+			break;
+
+		case UAS_TMF_ABORT_TASK_SET:
+		case UAS_TMF_CLEAR_TASK_SET:
+		case UAS_TMF_LOGICAL_UNIT_RESET:
+		case UAS_TMF_IT_NEXUS_RESET:
+			for(int i = 0; i < MSC_UAS_QUEUE_DEPTH; i++) {
+				uasQueue[i].used = false;
+			}
+			mtdClose();
+			uasSendResponse(tag, UAS_RC_TMF_COMPLETE);
+			break;
+
+		case UAS_TMF_QUERY_TASK:
+		{
+			uint8_t code = UAS_RC_TMF_COMPLETE;
+			for(int i = 0; i < MSC_UAS_QUEUE_DEPTH; i++) {
+				if(uasQueue[i].used && taskTag == uasQueue[i].tag) {
+					code = UAS_RC_TMF_SUCCEEDED;
+				}
+			}
+			uasSendResponse(tag, code);
+			break;
+		}
+
+		default:
+			uasSendResponse(tag, UAS_RC_TMF_NOT_SUPPORTED);
+			break;
+	}
+}
+
+bool MSC_::uasReceive()
+{
+	// Receive the whole packet so a longer IU than expected is seen as such
+	// rather than split into two
+	COMPILER_WORD_ALIGNED
+	uint8_t buffer[MSC_BULK_OUT_EP_SIZE];
+	static_assert(sizeof(buffer) >= sizeof(struct uas_command_iu), "IU buffer size");
+	const struct uas_command_iu &iu = *(const struct uas_command_iu *)buffer;
+	int recv = (int)USB_Recv(MSC_UAS_CMD_EP, buffer, sizeof(buffer));
+	if(recv <= 0) {
+		return false;
+	}
+
+	DBUG("uasReceive: ");
+	DBUGLN(iu.bIUID, HEX);
+
+	// No additional CDB bytes are supported, so both IUs have a fixed length
+	if(UAS_IU_COMMAND == iu.bIUID && recv == (int)sizeof(struct uas_command_iu)) {
+		uasQueueCommand(&iu);
+	} else if(UAS_IU_TASK_MANAGEMENT == iu.bIUID && recv == (int)sizeof(struct uas_task_management_iu)) {
+		uasTaskManagement(&iu);
+	} else {
+		uasSendResponse(recv >= 4 ? getBE16((const uint8_t *)&iu.wTag) : 0, UAS_RC_INVALID_IU);
+	}
+	return true;
+}
+
+// True if a reached the queue before b
+static bool uasOlder(const MSCUasCommand &a, const MSCUasCommand &b)
+{
+	return (int16_t)(a.sequence - b.sequence) < 0;
+}
+
+// Block commands that change the medium
+static bool isWriteCommand(uint8_t opcode)
+{
+	return SBC_CMD_WRITE_10 == opcode || SBC_CMD_WRITE_VERIFY_10 == opcode;
+}
+
+// True if a and b touch the same blocks and at least one of them writes
+static bool uasOverlaps(const MSCUasCommand &a, const MSCUasCommand &b)
+{
+	if(0 == a.blocks || 0 == b.blocks ||
+		 (!isWriteCommand(a.cdb[0]) && !isWriteCommand(b.cdb[0]))) {
+		return false;
+	}
+	return a.lba < b.lba + b.blocks && b.lba < a.lba + a.blocks;
+}
+
+bool MSC_::uasReady(int slot)
+{
+	MSCUasCommand &cmd = uasQueue[slot];
+	if(cmd.blocks > 0 && locks.conflicts(cmd.lba, cmd.blocks)) {
+		// Waits for the application to unlock, others can overtake it
+		return false;
+	}
+
+	for(int i = 0; i < MSC_UAS_QUEUE_DEPTH; i++)
+	{
+		MSCUasCommand &older = uasQueue[i];
+		if(!older.used || i == slot || !uasOlder(older, cmd)) {
+			continue;
+		}
+		if(UAS_TASK_ATTR_HEAD == cmd.attribute) {
+			// Only goes after HEAD OF QUEUE commands received before it
+			if(UAS_TASK_ATTR_HEAD == older.attribute) {
+				return false;
+			}
+			continue;
+		}
+		// ORDERED waits for everything older and holds back everything newer,
+		// SIMPLE only keeps its place against commands sharing blocks with a write
+		if(UAS_TASK_ATTR_SIMPLE != cmd.attribute || UAS_TASK_ATTR_SIMPLE != older.attribute ||
+			 uasOverlaps(cmd, older)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int MSC_::uasSchedule()
+{
+	int next = -1;
+	uint8_t rank = 0;
+	uint32_t nearest = 0;
+
+	// HEAD OF QUEUE goes first, then commands that do not touch the medium,
+	// then READ/WRITE overtaken too often. The rest are serviced in ascending
+	// block order from the last one so contiguous requests follow each other
+	// through the open Mtd transfer. Ties go to the oldest.
+	for(int i = 0; i < MSC_UAS_QUEUE_DEPTH; i++)
+	{
+		MSCUasCommand &cmd = uasQueue[i];
+		if(!cmd.used || !uasReady(i)) {
+			continue;
+		}
+		uint8_t order = UAS_TASK_ATTR_HEAD == cmd.attribute ? 0 :
+			0 == cmd.blocks ? 1 :
+			cmd.overtaken >= MSC_UAS_MAX_OVERTAKE ? 2 : 3;
+		uint32_t distance = 3 == order ? cmd.lba - uasHead : 0;
+		if(next < 0 || order < rank ||
+			 (order == rank && (distance < nearest ||
+				(distance == nearest && uasOlder(cmd, uasQueue[next])))))
+		{
+			next = i;
+			rank = order;
+			nearest = distance;
+		}
+	}
+
+	return next;
+}
+
+void MSC_::uasExecute(int slot)
+{
+	MSCUasCommand &cmd = uasQueue[slot];
+	for(int i = 0; i < MSC_UAS_QUEUE_DEPTH; i++) {
+		if(uasQueue[i].used && uasOlder(uasQueue[i], cmd) && uasQueue[i].overtaken < 0xFF) {
+			uasQueue[i].overtaken++;
+		}
+	}
+
+	uint8_t cdb[sizeof(cmd.cdb)];
+	memcpy(cdb, cmd.cdb, sizeof(cdb));
+	cmd.used = false;
+	if(cmd.blocks > 0) {
+		uasHead = cmd.lba + cmd.blocks;
+	}
+
+	uasTag = cmd.tag;
+	dataLength = 0xFFFFFFFF;
+	dataDone = 0;
+
+	uint8_t status = scsiCommand(cdb);
+	uasSendSense(uasTag, status);
 }
 
 void MSC_::poll()
 {
-	static struct usb_msc_cbw udi_msc_cbw;
-	uint32_t recv = USB_Recv(MSC_BULK_IN_EP, &udi_msc_cbw, sizeof(udi_msc_cbw));
-	if(recv > 0) {
+	serviceRequests();
+
+	// Accept everything the host has queued before picking what to run
+	while(uasReceive()) {
+	}
+
+	int slot = uasSchedule();
+	if(slot >= 0) {
+		uasExecute(slot);
+	}
+}
+
+#else
+
+void MSC_::botReset()
+{
+	DBUGLN("botReset");
+
+	// Anything still in flight was abandoned by readBlocks()/writeBlocks()
+	// when they saw resetPending, abort the Mtd transfer it left open
+	resetPending = false;
+	botWaiting = false;
+	mtdClose();
+	dataLength = 0;
+	dataDone = 0;
+	phaseError = false;
+	setSense(SCSI_SENSE_NO_SENSE, SCSI_ASC_NO_ADDITIONAL_SENSE_INFO);
+}
+
+void MSC_::botFinishData()
+{
+	// Cases 4, 5, 9 and 11, or a command that failed part way: the host still
+	// expects the rest of its data phase. Pad IN with fill bytes and discard
+	// OUT rather than stalling, the Arduino cores ignore Clear Feature HALT
+	// on endpoints so a stall here would only end in a host timeout. The CSW
+	// residue tells the host how much of it was real.
+	uint32_t left = dataLength - dataDone;
+	if(dataIn && left > 0) {
+		memset(blockBuffer, 0, sizeof(blockBuffer));
+	}
+
+	while(left > 0 && !resetPending)
+	{
+		uint32_t length = min(left, (uint32_t)sizeof(blockBuffer));
+		if(dataIn) {
+			if((uint32_t)USB_SendData(MSC_BULK_IN_EP, blockBuffer, length) != length) {
+				return;
+			}
+		} else {
+			int recv = (int)USB_Recv(MSC_BULK_OUT_EP, blockBuffer, length);
+			if(recv < 0) {
+				return;
+			}
+			length = recv;
+		}
+		left -= length;
+	}
+}
+
+void MSC_::botCommand()
+{
+	static_assert(sizeof(struct usb_msc_cbw) == sizeof(botCbw), "CBW buffer size");
+	struct usb_msc_cbw &cbw = *(struct usb_msc_cbw *)botCbw;
+
+	if(!botWaiting)
+	{
+		// Receive the whole packet so a longer one than a CBW is seen as such
+		// rather than its tail taken for the next CBW
+		COMPILER_WORD_ALIGNED
+		uint8_t buffer[MSC_BULK_OUT_EP_SIZE];
+		static_assert(sizeof(buffer) >= sizeof(botCbw), "CBW packet buffer size");
+		int recv = (int)USB_Recv(MSC_BULK_OUT_EP, buffer, sizeof(buffer));
+		if(recv <= 0) {
+			return;
+		}
+
 		DBUG("poll: got ");
 		DBUGLN(recv);
+
+		// The signature constants read as big-endian, "USBC" on the wire
+		if(recv != sizeof(cbw) || USB_CBW_SIGNATURE != getBE32(buffer)) {
+			// Not a valid CBW, stall both pipes until the host does a reset recovery
+			DBUGLN("poll: invalid CBW");
+			botHalted = true;
+			USB_Halt(MSC_BULK_IN_EP);
+			USB_Halt(MSC_BULK_OUT_EP);
+			return;
+		}
+		memcpy(botCbw, buffer, sizeof(botCbw));
+		botWaiting = true;
+	}
+
+	// Hold the CBW while the application has any of its blocks locked
+	if(isBlockCommand(cbw.CDB[0])) {
+		if(locks.conflicts(getBE32(cbw.CDB + 2), getBE16(cbw.CDB + 7))) {
+			return;
+		}
+	}
+	botWaiting = false;
+
+	dataLength = cbw.dCBWDataTransferLength;
+	dataDone = 0;
+	dataIn = USB_CBW_DIRECTION_IN == (cbw.bmCBWFlags & USB_CBW_DIRECTION_IN);
+	phaseError = false;
+
+	uint8_t status;
+	if(cbw.bCBWLUN >= MSC_LUN_COUNT) {
+		setSense(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_LOGICAL_UNIT_NOT_SUPPORTED);
+		status = SCSI_STATUS_CHECK_CONDITION;
+	} else if(0 == cbw.bCBWCBLength || cbw.bCBWCBLength > sizeof(cbw.CDB)) {
+		// Valid but not meaningful
+		setSense(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD_IN_CDB);
+		status = SCSI_STATUS_CHECK_CONDITION;
+	} else {
+		status = scsiCommand(cbw.CDB);
+	}
+
+	// Reset recovery drops the command, no CSW. The host gives up on a long
+	// data phase with a reset, so check again once the padding has stopped.
+	if(resetPending) {
+		return;
 	}
+	botFinishData();
+	if(resetPending) {
+		return;
+	}
+
+	struct usb_msc_csw csw;
+	putBE32((uint8_t *)&csw.dCSWSignature, USB_CSW_SIGNATURE);
+	csw.dCSWTag = cbw.dCBWTag;
+	csw.dCSWDataResidue = dataLength - dataDone;
+	csw.bCSWStatus = phaseError ? USB_CSW_STATUS_PE :
+		SCSI_STATUS_GOOD == status ? USB_CSW_STATUS_PASS : USB_CSW_STATUS_FAIL;
+	USB_SendData(MSC_BULK_IN_EP, &csw, sizeof(csw));
+}
+
+void MSC_::poll()
+{
+	if(resetPending) {
+		botReset();
+	}
+	serviceRequests();
+	if(!botHalted) {
+		botCommand();
+	}
+}
+
+#endif
 
+bool MSC_::submit(MtdRequest &request)
+{
+	request.done = false;
+	return requests.push(&request);
+}
+
+MtdRet MSC_::applicationTransfer(MtdRequest &request)
+{
+	if(0 == request.nb_block ||
+		 request.start > mtd.getCapacity() || request.nb_block > mtd.getCapacity() - request.start) {
+		return MtdRet_Invalid;
+	}
+
+	// The host transfer left open for merging does not cover these blocks
+	mtdClose();
+
+	MtdRet ret;
+	if(MtdOp_Read == request.op) {
+		ret = mtd.initReadBlocks(request.start, request.nb_block);
+		if(MtdRet_Ok == ret) {
+			ret = mtd.startReadBlocks(request.buffer, request.nb_block);
+			MtdRet end = mtd.waitEndOfReadBlocks(MtdRet_Ok != ret);
+			if(MtdRet_Ok == ret) {
+				ret = end;
+			}
+		}
+	} else {
+		ret = mtd.initWriteBlocks(request.start, request.nb_block);
+		if(MtdRet_Ok == ret) {
+			ret = mtd.startWriteBlocks(request.buffer, request.nb_block);
+			MtdRet end = mtd.waitEndOfWriteBlocks(MtdRet_Ok != ret);
+			if(MtdRet_Ok == ret) {
+				ret = end;
+			}
+			// Even a failed write may have changed some of the blocks
+			mediumChanged = true;
+		}
+	}
+	return ret;
+}
+
+void MSC_::serviceRequests()
+{
+	// Host commands run to completion inside poll(), so nothing of theirs is
+	// in flight here and application requests only have to wait their turn
+	MtdRequest *request;
+	while(NULL != (request = requests.peek()))
+	{
+		MtdRet ret;
+		switch(request->op)
+		{
+			case MtdOp_Read:
+			case MtdOp_Write:
+				ret = applicationTransfer(*request);
+				break;
+
+			// A range of no blocks would sit in a slot that still counts as free
+			case MtdOp_Lock:
+				ret = 0 == request->nb_block ? MtdRet_Invalid :
+					locks.lock(request->start, request->nb_block) ? MtdRet_Ok : MtdRet_Busy;
+				break;
+
+			case MtdOp_Unlock:
+				ret = 0 != request->nb_block && locks.unlock(request->start, request->nb_block) ?
+					MtdRet_Ok : MtdRet_Invalid;
+				break;
+
+			default:
+				ret = MtdRet_NotImplemented;
+				break;
+		}
+
+		request->result = ret;
+		requests.pop();
+		MTD_BARRIER();
+		request->done = true;
+	}
 }
 
-MSC_::MSC_(void) : PluggableUSBModule(TOTAL_EP - 1, 1, epType)
+MSC_::MSC_(void) : PluggableUSBModule(TOTAL_EP - 1, 1, epType),
+	senseKey(SCSI_SENSE_NO_SENSE), senseCode(SCSI_ASC_NO_ADDITIONAL_SENSE_INFO),
+	dataLength(0), dataDone(0), dataIn(false), phaseError(false),
+	resetPending(false), botHalted(false), botWaiting(false), mediumChanged(false),
+	mtdOp(MSC_MTD_IDLE), mtdLba(0), mtdLeft(0)
 {
+#if MSC_UAS
+	epType[0] = EP_TYPE_BULK_OUT_MSC;	// MSC_UAS_CMD_EP
+	epType[1] = EP_TYPE_BULK_IN_MSC;	// MSC_UAS_STATUS_EP
+	epType[2] = EP_TYPE_BULK_IN_MSC;	// MSC_DATA_IN_EP
+	epType[3] = EP_TYPE_BULK_OUT_MSC;	// MSC_DATA_OUT_EP
+	memset(uasQueue, 0, sizeof(uasQueue));
+	uasTag = 0;
+	uasHead = 0;
+	uasSequence = 0;
+#else
 	epType[0] = EP_TYPE_BULK_OUT_MSC;	// MSC_ENDPOINT_OUT
 	epType[1] = EP_TYPE_BULK_IN_MSC;	// MSC_ENDPOINT_IN
+#endif
 	PluggableUSB().plug(this);
 }
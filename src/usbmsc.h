@@ -10,32 +10,113 @@
 #include <stdint.h>
 #include <Arduino.h>
 #include "usb.h"
+#include "mtdarbiter.h"
 
+// Transport protocol, 0x50 for Bulk-Only Transport or 0x62 for USB Attached SCSI
+#ifndef MSC_PROTOCOL
+#define MSC_PROTOCOL                    0x50
+#endif
+#define MSC_UAS                         (MSC_PROTOCOL == 0x62)
+
+// Number of logical units, each one needs its own Mtd
+#ifndef MSC_LUN_COUNT
+#define MSC_LUN_COUNT                   1
+#endif
+
+#if MSC_UAS
+// Total number of endpoint is 5 control endpoint -1, Command, Status, Data IN and Data OUT -4
+#define TOTAL_EP                        5
+#else
 // Total number of endpoint is 3 control endpoint -1, BULK OUT Endpoint -2
 #define TOTAL_EP                        3
+#endif
 // Default Control Endpoint is 0 
 #define CTRL_EP                         0
 
+// Endpoints are numbered from the first one PluggableUSB assigns, the
+// descriptors in flash use these offsets and are patched when sent
 #define MSC_FIRST_ENDPOINT              pluggedEndpoint
-// BULK IN Endpoint
-#define MSC_BULK_IN_EP                  pluggedEndpoint
+#define MSC_EP(_offset)                 ((uint8_t)(pluggedEndpoint+(_offset)))
 // BULK OUT Endpoint 
-#define MSC_BULK_OUT_EP                 ((uint8_t)(pluggedEndpoint+1))
+#define MSC_BULK_OUT_EP_OFFSET          0
+#define MSC_BULK_OUT_EP                 MSC_EP(MSC_BULK_OUT_EP_OFFSET)
+// BULK IN Endpoint
+#define MSC_BULK_IN_EP_OFFSET           1
+#define MSC_BULK_IN_EP                  MSC_EP(MSC_BULK_IN_EP_OFFSET)
 // Control Endpoint size - 64 bytes 
 #define CTRL_EP_SIZE                    64
-// BULK IN/OUT Endpoint size - 64 bytes 
-#define MSC_BULK_IN_EP_SIZE             64
-#define MSC_BULK_OUT_EP_SIZE            64
-#define MSC_MAX_EP_SIZE            			64
+// BULK IN/OUT Endpoint size - the architecture's bulk endpoint size
+#define MSC_BULK_IN_EP_SIZE             MSC_BUFFER_SIZE
+#define MSC_BULK_OUT_EP_SIZE            MSC_BUFFER_SIZE
 
+#if MSC_UAS
+// UAS Command pipe, host to device
+#define MSC_UAS_CMD_EP_OFFSET           0
+#define MSC_UAS_CMD_EP                  MSC_EP(MSC_UAS_CMD_EP_OFFSET)
+// UAS Status pipe, device to host
+#define MSC_UAS_STATUS_EP_OFFSET        1
+#define MSC_UAS_STATUS_EP               MSC_EP(MSC_UAS_STATUS_EP_OFFSET)
+// UAS Data-in and Data-out pipes
+#define MSC_DATA_IN_EP_OFFSET           2
+#define MSC_DATA_IN_EP                  MSC_EP(MSC_DATA_IN_EP_OFFSET)
+#define MSC_DATA_OUT_EP_OFFSET          3
+#define MSC_DATA_OUT_EP                 MSC_EP(MSC_DATA_OUT_EP_OFFSET)
+// Number of commands the host may have outstanding
+#ifndef MSC_UAS_QUEUE_DEPTH
+#define MSC_UAS_QUEUE_DEPTH             4
+#endif
+// A READ/WRITE overtaken this many times by newer ones runs next, so the
+// block ordering cannot hold it back until the host times out
+#ifndef MSC_UAS_MAX_OVERTAKE
+#define MSC_UAS_MAX_OVERTAKE            8
+#endif
+#else
+// BOT moves data over the same bulk pipes as the CBW/CSW
+#define MSC_DATA_IN_EP                  MSC_BULK_IN_EP
+#define MSC_DATA_OUT_EP                 MSC_BULK_OUT_EP
+#endif
 
-// MSC class specific request
-#define GET_MAX_LUN                     0xA1
-#define MASS_STORAGE_RESET              0x21
+// Size of the block buffer, the Mtd block size
+#define MSC_BLOCK_SIZE                  512
 
 #define D_MSC_EP(_addr, _packetSize) \
   D_ENDPOINT(_addr, 0x02, _packetSize, 0)
 
+#define D_PIPE_USAGE(_pipeId) \
+  { 4, 0x24, _pipeId, 0 }
+
+_Pragma("pack(1)")
+
+typedef struct
+{
+  uint8_t len;      // 4
+  uint8_t dtype;    // 0x24
+  uint8_t pipeId;
+  uint8_t reserved;
+} PipeUsageDescriptor;
+
+#if MSC_UAS
+typedef struct
+{
+  InterfaceDescriptor msc;
+  EndpointDescriptor cmd;
+  PipeUsageDescriptor cmdPipe;
+  EndpointDescriptor status;
+  PipeUsageDescriptor statusPipe;
+  EndpointDescriptor in;
+  PipeUsageDescriptor inPipe;
+  EndpointDescriptor out;
+  PipeUsageDescriptor outPipe;
+} MSCDescriptor;
+#else
+typedef struct
+{
+  InterfaceDescriptor msc;
+  EndpointDescriptor in;
+  EndpointDescriptor out;
+} MSCDescriptor;
+#endif
+
 #ifndef DOXYGEN_ARD
 // the following would confuse doxygen documentation tool, so skip in that case for autodoc build
 _Pragma("pack()")
@@ -44,13 +125,129 @@ _Pragma("pack()")
 
 #endif
 
+#if MSC_UAS
+/// A UAS command received on the command pipe and waiting to be serviced
+typedef struct
+{
+  bool used;
+  uint16_t tag;
+  uint8_t cdb[16];
+  // SIMPLE or HEAD OF QUEUE, anything else is run as ORDERED
+  uint8_t attribute;
+  // Arrival order, and the number of newer commands run ahead of this one
+  uint16_t sequence;
+  uint8_t overtaken;
+  // First block and length for READ/WRITE, used to order and merge requests
+  uint32_t lba;
+  uint16_t blocks;
+} MSCUasCommand;
+#endif
+
 /**
  	 Concrete MSC implementation of a PluggableUSBModule
  */
 class MSC_ : public PluggableUSBModule
 {
 private:
-  uint32_t epType[2];
+  EPTYPE_DESCRIPTOR_SIZE epType[TOTAL_EP - 1];
+
+  Mtd mtd;
+
+  // Sense data of the last failed command
+  uint8_t senseKey;
+  uint16_t senseCode;
+
+  // Bytes the host allows in the data phase of the current command and the bytes moved so far
+  uint32_t dataLength;
+  uint32_t dataDone;
+  // Direction of the data phase the host expects
+  bool dataIn;
+  // Host and device disagree on the data phase, reported in the CSW
+  bool phaseError;
+
+  // Set by a Bulk-Only Mass Storage Reset, handled by poll()
+  volatile bool resetPending;
+  // Both bulk pipes stalled after an invalid CBW, until reset recovery
+  volatile bool botHalted;
+  // A CBW received but held back by an application range lock
+  bool botWaiting;
+  uint8_t botCbw[31];
+
+  // Application requests and the block ranges they have locked against the host
+  MtdRequestQueue requests;
+  MtdRangeLocks locks;
+  // Set by an application write, reported to the host as a UNIT ATTENTION
+  bool mediumChanged;
+
+  // Mtd transfer left open between commands so contiguous requests stream through it
+  uint8_t mtdOp;
+  uint32_t mtdLba;
+  uint16_t mtdLeft;
+
+#if MSC_UAS
+  MSCUasCommand uasQueue[MSC_UAS_QUEUE_DEPTH];
+  // Tag of the command being serviced
+  uint16_t uasTag;
+  // Block following the last READ/WRITE, where the next one is picked from
+  uint32_t uasHead;
+  // Sequence number of the next command received
+  uint16_t uasSequence;
+#endif
+
+  /// Run a SCSI command, moving any data through sendData()/recvData()
+  ///   \return the SCSI status
+  uint8_t scsiCommand(const uint8_t *cdb);
+  /// Start the data phase of a command, checking it against what the host expects
+  ///   \return false if no data should be moved
+  bool dataPhase(bool in, uint32_t length);
+  /// Send a short response as the whole data phase of a command
+  bool sendResponse(const void *data, uint32_t length);
+  /// Send data to the host, truncated to what the host asked for
+  bool sendData(const void *data, uint32_t length);
+  /// Receive data from the host
+  bool recvData(void *data, uint32_t length);
+  /// Transfer blocks between the host and the Mtd
+  bool readBlocks(uint32_t lba, uint16_t count);
+  /// Writes can also run a CRC over the data from the host
+  bool writeBlocks(uint32_t lba, uint16_t count, uint32_t *crc = NULL);
+  /// Read blocks without sending them, optionally running a CRC over them
+  bool verifyBlocks(uint32_t lba, uint16_t count, uint32_t *crc);
+  /// VERIFY(10) and WRITE AND VERIFY(10)
+  uint8_t verifyCommand(const uint8_t *cdb, uint32_t lba, uint16_t count);
+  /// Make sure a Mtd transfer covering the blocks is open
+  bool mtdOpen(uint8_t op, uint32_t lba, uint16_t count);
+  /// Abort any open Mtd transfer
+  void mtdClose();
+  /// Number of blocks of queued requests that continue on from lba
+  uint16_t mergeAhead(uint8_t op, uint32_t lba);
+  /// Run the queued application requests
+  void serviceRequests();
+  MtdRet applicationTransfer(MtdRequest &request);
+  void setSense(uint8_t key, uint16_t code);
+  /// Fill a fixed format sense data buffer and clear the sense data
+  uint8_t takeSense(uint8_t *buffer);
+
+#if MSC_UAS
+  /// Read one IU from the command pipe
+  bool uasReceive();
+  void uasQueueCommand(const void *iu);
+  void uasTaskManagement(const void *iu);
+  /// Check a queued command does not have to wait for an older one or a range lock
+  bool uasReady(int slot);
+  /// Pick the next queued command to service, -1 if none
+  int uasSchedule();
+  void uasExecute(int slot);
+  void uasSendReady(uint8_t iuId);
+  void uasSendSense(uint16_t tag, uint8_t status);
+  void uasSendResponse(uint16_t tag, uint8_t code);
+#else
+  /// Service a CBW from the bulk OUT pipe
+  void botCommand();
+  /// Drop the current command after a Bulk-Only Mass Storage Reset
+  void botReset();
+  /// Move what is left of the data phase the host asked for
+  void botFinishData();
+#endif
 
 protected:
   // Implementation of the PUSBListNode
@@ -58,9 +255,9 @@ protected:
   /// Creates a MSCDescriptor interface and sollicit USBDevice to send control to it.
   ///   \see USBDevice::SendControl()
   int getInterface(uint8_t* interfaceNum);
-  /// Current implementation just returns 0
+  /// MSC has no class specific descriptors, always returns 0 so the core answers
   int getDescriptor(USBSetup& setup);
-  /// Optional interface usb setup callback, current implementation returns false
+  /// Handles the BOT class requests, Get Max LUN and Bulk-Only Mass Storage Reset
   bool setup(USBSetup& setup);
   /// MSC Device short name, defaults to "MSC" and returns a length of 4 chars
   uint8_t getShortName(char* name);
@@ -68,12 +265,24 @@ protected:
   void handleEndpoint(uint8_t ep);
 
 public:
-	/// Creates a MSC USB device with 2 endpoints
+	/// Creates a MSC USB device with 2 endpoints, or 4 for UAS
 	MSC_(void);
 
   /// Poll to see if there is stuff to do
   void poll();
 
+  /// Queue a block read/write or range lock from application context, run by
+  /// poll() between host commands. Host READ/WRITE touching a locked range
+  /// wait until it is unlocked, request.done is set once it has been run.
+  /// The host is not told what an application write changed, only that the
+  /// medium may have changed: its next command fails with a UNIT ATTENTION
+  /// so it re-reads the medium. A host with the volume mounted keeps its
+  /// cached view regardless and may overwrite the blocks when it next writes
+  /// them, locks only protect the blocks while they are held. Only write
+  /// blocks the host leaves alone, or while it does not have them mounted.
+  ///   \return false if the queue is full
+  bool submit(MtdRequest &request);
+
 	/// NIY
 	operator bool();
 };
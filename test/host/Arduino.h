@@ -0,0 +1,112 @@
+// Just enough of the Arduino SAMD core for usbmsc.cpp to build and run on
+// the host, the USB controller behind it is the fake in fake_usb.h
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+#define PROGMEM
+#define pgm_read_byte(addr)             (*(const uint8_t *)(addr))
+#define pgm_read_dword(addr)            (*(const uint32_t *)(addr))
+#define memcpy_P                        memcpy
+
+#define EPX_SIZE                        64
+#define TRANSFER_PGM                    0x80
+
+#define USB_ENDPOINT_TYPE_BULK          0x02
+#define USB_ENDPOINT_OUT(addr)          ((addr) | 0x00)
+#define USB_ENDPOINT_IN(addr)           ((addr) | 0x80)
+
+#define USB_DEVICE_DESCRIPTOR_TYPE      1
+#define USB_INTERFACE_DESCRIPTOR_TYPE   4
+#define USB_ENDPOINT_DESCRIPTOR_TYPE    5
+
+#define REQUEST_HOSTTODEVICE_CLASS_INTERFACE  0x21
+#define REQUEST_DEVICETOHOST_CLASS_INTERFACE  0xA1
+
+// USB->DEVICE.DeviceEndpoint[ep].EPSTATUSSET/EPSTATUSCLR bits
+#define USB_DEVICE_EPSTATUSSET_STALLRQ0 (1 << 4)
+#define USB_DEVICE_EPSTATUSSET_STALLRQ1 (1 << 5)
+#define USB_DEVICE_EPSTATUSCLR_DTGLOUT  (1 << 0)
+#define USB_DEVICE_EPSTATUSCLR_DTGLIN   (1 << 1)
+#define USB_DEVICE_EPSTATUSCLR_STALLRQ0 (1 << 4)
+#define USB_DEVICE_EPSTATUSCLR_STALLRQ1 (1 << 5)
+
+#pragma pack(push, 1)
+
+typedef struct
+{
+  uint8_t bmRequestType;
+  uint8_t bRequest;
+  uint8_t wValueL;
+  uint8_t wValueH;
+  uint16_t wIndex;
+  uint16_t wLength;
+} USBSetup;
+
+typedef struct
+{
+  uint8_t len;
+  uint8_t dtype;
+  uint8_t number;
+  uint8_t alternate;
+  uint8_t numEndpoints;
+  uint8_t interfaceClass;
+  uint8_t interfaceSubClass;
+  uint8_t protocol;
+  uint8_t iInterface;
+} InterfaceDescriptor;
+
+typedef struct
+{
+  uint8_t len;
+  uint8_t dtype;
+  uint8_t addr;
+  uint8_t attr;
+  uint16_t packetSize;
+  uint8_t interval;
+} EndpointDescriptor;
+
+#pragma pack(pop)
+
+#define D_INTERFACE(_n, _numEndpoints, _class, _subClass, _protocol) \
+  { 9, 4, _n, 0, _numEndpoints, _class, _subClass, _protocol, 0 }
+
+#define D_ENDPOINT(_addr, _attr, _packetSize, _interval) \
+  { 7, 5, _addr, _attr, _packetSize, _interval }
+
+// Endpoint status register, writes are passed on to the fake controller
+class FakeEpStatusReg
+{
+  public:
+    uint8_t ep;
+    bool set;
+    FakeEpStatusReg &operator=(uint32_t value);
+};
+
+struct FakeEpStatus { FakeEpStatusReg reg; };
+struct FakeDeviceEndpoint { FakeEpStatus EPSTATUSSET; FakeEpStatus EPSTATUSCLR; };
+struct FakeUsbDevice { FakeDeviceEndpoint DeviceEndpoint[8]; };
+struct FakeUsb { FakeUsbDevice DEVICE; };
+extern FakeUsb *const USB;
+
+class USBDeviceClass
+{
+  public:
+    uint32_t sendControl(int flags, const void *data, uint32_t len);
+    void sendZlp(uint32_t ep);
+    uint32_t available(uint32_t ep);
+    int recv(uint32_t ep, void *data, uint32_t len);
+    uint32_t send(uint32_t ep, const void *data, uint32_t len);
+    void flush(uint32_t ep);
+    void stall(uint32_t ep);
+};
+extern USBDeviceClass USBDevice;
+
+#endif
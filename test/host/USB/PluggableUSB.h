@@ -0,0 +1,53 @@
+// PluggableUSB with a single module, enough to drive MSC_ from the tests
+#ifndef PUSB_h
+#define PUSB_h
+
+#include <Arduino.h>
+
+class PluggableUSBModule
+{
+  public:
+    PluggableUSBModule(uint8_t numEps, uint8_t numIfs, uint32_t *epType) :
+      numEndpoints(numEps), numInterfaces(numIfs), endpointType(epType)
+    { }
+
+  protected:
+    virtual bool setup(USBSetup& setup) = 0;
+    virtual int getInterface(uint8_t* interfaceCount) = 0;
+    virtual int getDescriptor(USBSetup& setup) = 0;
+    virtual uint8_t getShortName(char *name) { name[0] = 'A' + pluggedInterface; return 1; }
+
+    uint8_t pluggedInterface;
+    uint8_t pluggedEndpoint;
+
+    const uint8_t numEndpoints;
+    const uint8_t numInterfaces;
+    const uint32_t *endpointType;
+
+    friend class PluggableUSB_;
+};
+
+class PluggableUSB_
+{
+  public:
+    PluggableUSB_() : module(NULL) { }
+
+    // The first interface and endpoint after the control endpoint, as on a board without CDC
+    bool plug(PluggableUSBModule *node) {
+      node->pluggedInterface = 0;
+      node->pluggedEndpoint = 1;
+      module = node;
+      return true;
+    }
+    int getInterface(uint8_t* interfaceCount) { return module->getInterface(interfaceCount); }
+    int getDescriptor(USBSetup& setup) { return module->getDescriptor(setup); }
+    bool setup(USBSetup& setup) { return module->setup(setup); }
+    const uint32_t *endpointType() { return module->endpointType; }
+
+  private:
+    PluggableUSBModule *module;
+};
+
+PluggableUSB_& PluggableUSB();
+
+#endif
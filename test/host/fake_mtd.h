@@ -0,0 +1,84 @@
+// Stands in for src/mtd.h (forced in with -include), an in-memory medium
+// that checks the Mtd call sequence and can be told to fail
+#ifndef __MTD_H
+#define __MTD_H
+
+#include <Arduino.h>
+#include <vector>
+
+typedef enum {
+  MtdRet_Ok,
+  MtdRet_Empty, /* No media */
+  MtdRet_NotImplemented, /* API not implemented */
+  MtdRet_Busy, /* No room for the request */
+  MtdRet_Invalid /* Request outside the device or not matching a lock */
+} MtdRet;
+
+typedef enum {
+  MtdState_Ready,
+  MtdState_Empty /* No media */
+} MtdState;
+
+#define FAKE_BLOCK_SIZE   512
+#define FAKE_BLOCK_COUNT  64
+
+struct FakeMedium
+{
+  enum Op { Idle, Read, Write };
+
+  std::vector<uint8_t> data;
+  MtdState state;
+  uint32_t blockSize;
+
+  // Transfer opened by init*Blocks()
+  Op op;
+  uint32_t lba;
+  uint32_t left;
+
+  // Blocks in the order they were read or written, writes as lba + 0x10000
+  std::vector<uint32_t> accesses;
+  int inits;
+  int zeroLengthInits;
+  int aborts;
+  int errors;                   // calls out of sequence
+  uint32_t failLba;             // read or write of this block fails
+  uint32_t corruptLba;          // write of this block stores a flipped bit
+
+  void reset();
+  uint8_t *block(uint32_t n) { return &data[n * FAKE_BLOCK_SIZE]; }
+};
+extern FakeMedium fakeMedium;
+
+class Mtd
+{
+  public:
+    MtdState getState() { return fakeMedium.state; }
+    uint32_t getCapacity() { return FAKE_BLOCK_COUNT; }
+    uint32_t getBlockSize() { return fakeMedium.blockSize; }
+
+    MtdRet initReadBlocks(uint32_t start, uint16_t nb_block) {
+      return init(FakeMedium::Read, start, nb_block);
+    }
+    MtdRet startReadBlocks(void *dest, uint16_t nb_block) {
+      return start(FakeMedium::Read, dest, nb_block);
+    }
+    MtdRet waitEndOfReadBlocks(bool abort) {
+      return waitEnd(FakeMedium::Read, abort);
+    }
+    MtdRet initWriteBlocks(uint32_t start, uint16_t nb_block) {
+      return init(FakeMedium::Write, start, nb_block);
+    }
+    MtdRet startWriteBlocks(const void *src, uint16_t nb_block) {
+      return start(FakeMedium::Write, (void *)src, nb_block);
+    }
+    MtdRet waitEndOfWriteBlocks(bool abort) {
+      return waitEnd(FakeMedium::Write, abort);
+    }
+
+  private:
+    MtdRet init(FakeMedium::Op op, uint32_t start, uint16_t nb_block);
+    MtdRet start(FakeMedium::Op op, void *buffer, uint16_t nb_block);
+    MtdRet waitEnd(FakeMedium::Op op, bool abort);
+};
+
+#endif
@@ -0,0 +1,239 @@
+#include "fake_usb.h"
+#include "fake_mtd.h"
+
+FakeController fakeUsb;
+USBDeviceClass USBDevice;
+FakeMedium fakeMedium;
+
+static FakeUsb usbRegisters;
+FakeUsb *const USB = &usbRegisters;
+
+PluggableUSB_& PluggableUSB()
+{
+  static PluggableUSB_ obj;
+  return obj;
+}
+
+//------------------------------------------------------------------------------
+// Controller
+
+void FakeController::reset()
+{
+  for(int i = 0; i < 8; i++) {
+    ep[i].out.clear();
+    ep[i].in.clear();
+    ep[i].halted = false;
+    ep[i].halts = 0;
+    ep[i].toggleResets = 0;
+    ep[i].sent = 0;
+    usbRegisters.DEVICE.DeviceEndpoint[i].EPSTATUSSET.reg.ep = i;
+    usbRegisters.DEVICE.DeviceEndpoint[i].EPSTATUSSET.reg.set = true;
+    usbRegisters.DEVICE.DeviceEndpoint[i].EPSTATUSCLR.reg.ep = i;
+    usbRegisters.DEVICE.DeviceEndpoint[i].EPSTATUSCLR.reg.set = false;
+  }
+  control.clear();
+  onStarve = nullptr;
+  onSend = nullptr;
+  starved = 0;
+}
+
+void FakeController::out(uint8_t n, const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  do {
+    size_t length = min(len, (size_t)EPX_SIZE);
+    ep[n].out.push_back(std::vector<uint8_t>(p, p + length));
+    p += length;
+    len -= length;
+  } while(len > 0);
+}
+
+std::vector<uint8_t> FakeController::in(uint8_t n, size_t len)
+{
+  len = min(len, ep[n].in.size());
+  std::vector<uint8_t> data(ep[n].in.begin(), ep[n].in.begin() + len);
+  ep[n].in.erase(ep[n].in.begin(), ep[n].in.begin() + len);
+  return data;
+}
+
+bool FakeController::classRequest(uint8_t bmRequestType, uint8_t bRequest, uint16_t wIndex, uint16_t wLength)
+{
+  USBSetup setup = { bmRequestType, bRequest, 0, 0, wIndex, wLength };
+  return PluggableUSB().setup(setup);
+}
+
+FakeEpStatusReg &FakeEpStatusReg::operator=(uint32_t value)
+{
+  FakeEndpoint &endpoint = fakeUsb.ep[ep];
+  if(value & (USB_DEVICE_EPSTATUSSET_STALLRQ0 | USB_DEVICE_EPSTATUSSET_STALLRQ1)) {
+    if(set) {
+      endpoint.halted = true;
+      endpoint.halts++;
+    } else {
+      endpoint.halted = false;
+    }
+  }
+  if(!set && (value & (USB_DEVICE_EPSTATUSCLR_DTGLOUT | USB_DEVICE_EPSTATUSCLR_DTGLIN))) {
+    endpoint.toggleResets++;
+  }
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+// Device side of the controller, what the SAMD core's USBDevice does
+
+uint32_t USBDeviceClass::sendControl(int, const void *data, uint32_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  fakeUsb.control.insert(fakeUsb.control.end(), p, p + len);
+  return len;
+}
+
+void USBDeviceClass::sendZlp(uint32_t)
+{
+}
+
+uint32_t USBDeviceClass::available(uint32_t ep)
+{
+  return fakeUsb.ep[ep].out.empty() ? 0 : fakeUsb.ep[ep].out.front().size();
+}
+
+int USBDeviceClass::recv(uint32_t ep, void *data, uint32_t len)
+{
+  FakeEndpoint &endpoint = fakeUsb.ep[ep];
+  if(endpoint.out.empty() && fakeUsb.onStarve) {
+    fakeUsb.onStarve(ep);
+  }
+  // A halted endpoint NAKs everything until the halt is cleared
+  if(endpoint.halted || endpoint.out.empty()) {
+    if(++fakeUsb.starved > 10000) {
+      throw FakeHang();
+    }
+    return 0;
+  }
+  fakeUsb.starved = 0;
+
+  std::vector<uint8_t> &packet = endpoint.out.front();
+  uint32_t length = min(len, (uint32_t)packet.size());
+  memcpy(data, packet.data(), length);
+  packet.erase(packet.begin(), packet.begin() + length);
+  if(packet.empty()) {
+    endpoint.out.pop_front();
+  }
+  return length;
+}
+
+uint32_t USBDeviceClass::send(uint32_t ep, const void *data, uint32_t len)
+{
+  FakeEndpoint &endpoint = fakeUsb.ep[ep];
+  if(endpoint.halted) {
+    return 0;
+  }
+  const uint8_t *p = (const uint8_t *)data;
+  endpoint.in.insert(endpoint.in.end(), p, p + len);
+  endpoint.sent += len;
+  if(fakeUsb.onSend) {
+    fakeUsb.onSend(ep, p, len);
+  }
+  return len;
+}
+
+void USBDeviceClass::flush(uint32_t)
+{
+}
+
+void USBDeviceClass::stall(uint32_t)
+{
+}
+
+//------------------------------------------------------------------------------
+// Medium
+
+void FakeMedium::reset()
+{
+  data.assign(FAKE_BLOCK_COUNT * FAKE_BLOCK_SIZE, 0);
+  for(uint32_t i = 0; i < FAKE_BLOCK_COUNT; i++) {
+    // Every block starts out different
+    memset(block(i), 0x80 | i, FAKE_BLOCK_SIZE);
+  }
+  state = MtdState_Ready;
+  blockSize = FAKE_BLOCK_SIZE;
+  op = Idle;
+  lba = 0;
+  left = 0;
+  accesses.clear();
+  inits = 0;
+  zeroLengthInits = 0;
+  aborts = 0;
+  errors = 0;
+  failLba = 0xFFFFFFFF;
+  corruptLba = 0xFFFFFFFF;
+}
+
+MtdRet Mtd::init(FakeMedium::Op op, uint32_t start, uint16_t nb_block)
+{
+  FakeMedium &m = fakeMedium;
+  if(MtdState_Ready != m.state) {
+    return MtdRet_Empty;
+  }
+  if(FakeMedium::Idle != m.op) {
+    // The previous transfer was neither finished nor aborted
+    m.errors++;
+  }
+  m.inits++;
+  if(0 == nb_block) {
+    m.zeroLengthInits++;
+    return MtdRet_Invalid;
+  }
+  if(start + nb_block > FAKE_BLOCK_COUNT) {
+    m.errors++;
+    return MtdRet_Invalid;
+  }
+  m.op = op;
+  m.lba = start;
+  m.left = nb_block;
+  return MtdRet_Ok;
+}
+
+MtdRet Mtd::start(FakeMedium::Op op, void *buffer, uint16_t nb_block)
+{
+  FakeMedium &m = fakeMedium;
+  if(op != m.op || nb_block > m.left) {
+    m.errors++;
+    return MtdRet_Invalid;
+  }
+  for(uint16_t i = 0; i < nb_block; i++, m.lba++, m.left--)
+  {
+    if(m.lba == m.failLba) {
+      return MtdRet_Invalid;
+    }
+    uint8_t *p = (uint8_t *)buffer + i * FAKE_BLOCK_SIZE;
+    if(FakeMedium::Read == op) {
+      memcpy(p, m.block(m.lba), FAKE_BLOCK_SIZE);
+      m.accesses.push_back(m.lba);
+    } else {
+      memcpy(m.block(m.lba), p, FAKE_BLOCK_SIZE);
+      if(m.lba == m.corruptLba) {
+        m.block(m.lba)[FAKE_BLOCK_SIZE / 2] ^= 0x01;
+      }
+      m.accesses.push_back(m.lba + 0x10000);
+    }
+  }
+  return MtdRet_Ok;
+}
+
+MtdRet Mtd::waitEnd(FakeMedium::Op op, bool abort)
+{
+  FakeMedium &m = fakeMedium;
+  if(op != m.op) {
+    m.errors++;
+    return MtdRet_Invalid;
+  }
+  if(abort) {
+    m.aborts++;
+    m.op = FakeMedium::Idle;
+  } else if(0 == m.left) {
+    m.op = FakeMedium::Idle;
+  }
+  return MtdRet_Ok;
+}
@@ -0,0 +1,49 @@
+// Fake USB device controller, the test plays the host on the other side
+#ifndef FAKE_USB_H
+#define FAKE_USB_H
+
+#include <Arduino.h>
+#include <USB/PluggableUSB.h>
+#include <deque>
+#include <vector>
+#include <functional>
+
+struct FakeEndpoint
+{
+  std::deque<std::vector<uint8_t> > out;  // packets from the host
+  std::deque<uint8_t> in;                 // bytes the host has not read yet
+  bool halted;
+  int halts;
+  int toggleResets;
+  uint32_t sent;                          // bytes sent since the last reset()
+};
+
+class FakeController
+{
+  public:
+    FakeEndpoint ep[8];
+    std::vector<uint8_t> control;
+
+    // Called when the device receives from an OUT endpoint with nothing
+    // queued, the test can send more data or a class request from here
+    std::function<void(uint8_t ep)> onStarve;
+    // Called after the device sent on an IN endpoint
+    std::function<void(uint8_t ep, const uint8_t *data, uint32_t len)> onSend;
+    // Consecutive receives that found nothing, a device waiting on data the
+    // host never sends would otherwise hang the test
+    int starved;
+
+    void reset();
+
+    // Host side
+    void out(uint8_t ep, const void *data, size_t len);
+    size_t inAvailable(uint8_t ep) { return this->ep[ep].in.size(); }
+    std::vector<uint8_t> in(uint8_t ep, size_t len);
+    bool classRequest(uint8_t bmRequestType, uint8_t bRequest, uint16_t wIndex, uint16_t wLength);
+};
+extern FakeController fakeUsb;
+
+// Thrown when the device keeps waiting for data that will never come
+struct FakeHang { };
+
+#endif
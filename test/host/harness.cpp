@@ -0,0 +1,47 @@
+#include "harness.h"
+
+static TestCase *tests = NULL;
+static TestCase **last = &tests;
+
+TestCase::TestCase(const char *name, TestFunction function) :
+  name(name), function(function), next(NULL)
+{
+  *last = this;
+  last = &next;
+}
+
+void testFail(const char *file, int line, const char *expression)
+{
+  printf("  %s:%d: CHECK(%s) failed\n", file, line, expression);
+  throw TestFailure();
+}
+
+void testFailValues(const char *file, int line, const char *expression, long long actual, long long expected)
+{
+  printf("  %s:%d: CHECK(%s) failed, got %lld (0x%llx) expected %lld (0x%llx)\n",
+    file, line, expression, actual, actual, expected, expected);
+  throw TestFailure();
+}
+
+int main()
+{
+  int run = 0;
+  int failed = 0;
+  for(TestCase *test = tests; test; test = test->next)
+  {
+    run++;
+    try {
+      testSetUp();
+      test->function();
+      printf("PASS %s\n", test->name);
+    } catch(TestFailure &) {
+      printf("FAIL %s\n", test->name);
+      failed++;
+    } catch(...) {
+      printf("FAIL %s: device hung waiting for the host\n", test->name);
+      failed++;
+    }
+  }
+  printf("%d tests, %d failed\n", run, failed);
+  return failed ? 1 : 0;
+}
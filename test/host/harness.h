@@ -0,0 +1,38 @@
+// Minimal test runner, a failed CHECK throws and ends the test
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef void (*TestFunction)();
+
+struct TestCase
+{
+  TestCase(const char *name, TestFunction function);
+  const char *name;
+  TestFunction function;
+  TestCase *next;
+};
+
+struct TestFailure { };
+
+void testFail(const char *file, int line, const char *expression);
+void testFailValues(const char *file, int line, const char *expression, long long actual, long long expected);
+
+#define TEST(_name) \
+  static void _name(); \
+  static TestCase _name##_case(#_name, _name); \
+  static void _name()
+
+#define CHECK(_cond) \
+  do { if(!(_cond)) testFail(__FILE__, __LINE__, #_cond); } while(0)
+
+#define CHECK_EQ(_actual, _expected) \
+  do { long long _a = (long long)(_actual), _e = (long long)(_expected); \
+    if(_a != _e) testFailValues(__FILE__, __LINE__, #_actual " == " #_expected, _a, _e); } while(0)
+
+// Run before every test, each test program defines it
+void testSetUp();
+
+#endif
@@ -0,0 +1,74 @@
+// Host side helpers shared by the tests
+#ifndef HOST_H
+#define HOST_H
+
+#include "usbmsc.h"
+#include "fake_usb.h"
+#include "harness.h"
+#include <stddef.h>
+
+#define COMPILER_PRAGMA(arg)            _Pragma(#arg)
+#define COMPILER_PACK_SET(alignment)    COMPILER_PRAGMA(pack(alignment))
+#define COMPILER_PACK_RESET()           COMPILER_PRAGMA(pack())
+
+typedef uint16_t                le16_t;
+typedef uint16_t                be16_t;
+typedef uint32_t                le32_t;
+typedef uint32_t                be32_t;
+
+#include "usb_protocol_msc.h"
+#include "scsi_commands.h"
+
+struct Cdb
+{
+  uint8_t bytes[16];
+  uint8_t length;
+};
+
+static inline Cdb cdb6(uint8_t opcode, uint8_t allocation = 0)
+{
+  Cdb cdb = { { opcode, 0, 0, 0, allocation, 0 }, 6 };
+  return cdb;
+}
+
+static inline Cdb cdb10(uint8_t opcode, uint32_t lba, uint16_t count, uint8_t flags = 0)
+{
+  Cdb cdb = { { opcode, flags,
+    (uint8_t)(lba >> 24), (uint8_t)(lba >> 16), (uint8_t)(lba >> 8), (uint8_t)lba,
+    0, (uint8_t)(count >> 8), (uint8_t)count, 0 }, 10 };
+  return cdb;
+}
+
+static inline Cdb inquiry(uint16_t allocation)
+{
+  Cdb cdb = { { SBC_CMD_INQUIRY, 0, 0, (uint8_t)(allocation >> 8), (uint8_t)allocation, 0 }, 6 };
+  return cdb;
+}
+
+static inline uint16_t be16(const uint8_t *p)
+{
+  return ((uint16_t)p[0] << 8) | p[1];
+}
+
+// Contents to write to a block, different from what the medium starts with
+static inline std::vector<uint8_t> pattern(uint8_t seed, uint16_t blocks = 1)
+{
+  std::vector<uint8_t> data(blocks * FAKE_BLOCK_SIZE);
+  for(size_t i = 0; i < data.size(); i++) {
+    data[i] = (uint8_t)(seed + i * 7);
+  }
+  return data;
+}
+
+static inline bool sameBlocks(const std::vector<uint8_t> &data, uint32_t lba)
+{
+  return 0 == memcmp(data.data(), fakeMedium.block(lba), data.size());
+}
+
+static inline void poll()
+{
+  fakeUsb.starved = 0;
+  MassStorage.poll();
+}
+
+#endif
@@ -0,0 +1,645 @@
+// Bulk-Only Transport: the 13 host/device cases, invalid CBWs and reset recovery
+#include "host.h"
+
+#define OUT_EP          1
+#define IN_EP           2
+
+static void cbw(uint32_t tag, uint32_t length, bool in, const Cdb &cdb, uint8_t lun = 0)
+{
+  struct usb_msc_cbw cbw;
+  memset(&cbw, 0, sizeof(cbw));
+  memcpy(&cbw.dCBWSignature, "USBC", 4);
+  cbw.dCBWTag = tag;
+  cbw.dCBWDataTransferLength = length;
+  cbw.bmCBWFlags = in ? USB_CBW_DIRECTION_IN : USB_CBW_DIRECTION_OUT;
+  cbw.bCBWLUN = lun;
+  cbw.bCBWCBLength = cdb.length;
+  memcpy(cbw.CDB, cdb.bytes, cdb.length);
+  fakeUsb.out(OUT_EP, &cbw, sizeof(cbw));
+}
+
+static void send(const std::vector<uint8_t> &data)
+{
+  fakeUsb.out(OUT_EP, data.data(), data.size());
+}
+
+static std::vector<uint8_t> receive(size_t length)
+{
+  CHECK(fakeUsb.inAvailable(IN_EP) >= length);
+  return fakeUsb.in(IN_EP, length);
+}
+
+// The CSW must be the last thing the device sent
+static struct usb_msc_csw csw(uint32_t tag)
+{
+  CHECK_EQ(fakeUsb.inAvailable(IN_EP), sizeof(struct usb_msc_csw));
+  struct usb_msc_csw csw;
+  std::vector<uint8_t> data = fakeUsb.in(IN_EP, sizeof(csw));
+  memcpy(&csw, data.data(), sizeof(csw));
+  CHECK(0 == memcmp(data.data(), "USBS", 4));
+  CHECK_EQ(csw.dCSWTag, tag);
+  return csw;
+}
+
+static void checkCsw(uint32_t tag, uint8_t status, uint32_t residue)
+{
+  struct usb_msc_csw c = csw(tag);
+  CHECK_EQ(c.bCSWStatus, status);
+  CHECK_EQ(c.dCSWDataResidue, residue);
+}
+
+static uint16_t requestSense(uint32_t tag)
+{
+  cbw(tag, SCSI_SENSE_DATA_LENGTH, true, cdb6(SBC_CMD_REQUEST_SENSE, SCSI_SENSE_DATA_LENGTH));
+  poll();
+  std::vector<uint8_t> sense = receive(SCSI_SENSE_DATA_LENGTH);
+  checkCsw(tag, USB_CSW_STATUS_PASS, 0);
+  return (sense[2] << 8) | sense[12];
+}
+
+static bool massStorageReset()
+{
+  return fakeUsb.classRequest(REQUEST_HOSTTODEVICE_CLASS_INTERFACE, USB_REQ_MSC_BULK_RESET, 0, 0);
+}
+
+// Reset recovery as the host does it, then check the device is back in step
+static void checkRecovers()
+{
+  if(fakeUsb.ep[IN_EP].halted || fakeUsb.ep[OUT_EP].halted) {
+    CHECK(massStorageReset());
+  }
+  fakeUsb.onStarve = nullptr;
+  fakeUsb.onSend = nullptr;
+  fakeUsb.ep[OUT_EP].out.clear();
+  poll();
+  CHECK_EQ(fakeUsb.inAvailable(IN_EP), 0);
+
+  cbw(0x5EC0, 0, false, cdb6(SBC_CMD_TEST_UNIT_READY));
+  poll();
+  checkCsw(0x5EC0, USB_CSW_STATUS_PASS, 0);
+  CHECK_EQ(fakeMedium.errors, 0);
+}
+
+void testSetUp()
+{
+  fakeUsb.reset();
+  fakeMedium.reset();
+  massStorageReset();
+  poll();
+  // Take any UNIT ATTENTION left by application writes
+  cbw(0, 0, false, cdb6(SBC_CMD_TEST_UNIT_READY));
+  poll();
+  fakeUsb.reset();
+}
+
+//------------------------------------------------------------------------------
+// Hn, Hi and Ho: the host expects no data, data in or data out
+// Dn, Di and Do: the device intends no data, data in or data out
+
+TEST(case_1_hn_dn)
+{
+  cbw(1, 0, false, cdb6(SBC_CMD_TEST_UNIT_READY));
+  poll();
+  checkCsw(1, USB_CSW_STATUS_PASS, 0);
+}
+
+TEST(case_2_hn_di)
+{
+  cbw(2, 0, true, inquiry(36));
+  poll();
+  checkCsw(2, USB_CSW_STATUS_PE, 0);
+}
+
+TEST(case_3_hn_do)
+{
+  cbw(3, 0, false, cdb10(SBC_CMD_WRITE_10, 4, 1));
+  poll();
+  checkCsw(3, USB_CSW_STATUS_PE, 0);
+  CHECK(fakeMedium.accesses.empty());
+}
+
+TEST(case_4_hi_dn)
+{
+  cbw(4, 64, true, cdb6(SBC_CMD_TEST_UNIT_READY));
+  poll();
+  receive(64);
+  checkCsw(4, USB_CSW_STATUS_PASS, 64);
+}
+
+TEST(case_5_hi_gt_di)
+{
+  cbw(5, 64, true, inquiry(36));
+  poll();
+  std::vector<uint8_t> data = receive(64);
+  CHECK_EQ(data[0], 0x00);
+  CHECK_EQ(data[4], 31);
+  checkCsw(5, USB_CSW_STATUS_PASS, 28);
+}
+
+TEST(case_6_hi_eq_di)
+{
+  cbw(6, 2 * FAKE_BLOCK_SIZE, true, cdb10(SBC_CMD_READ_10, 7, 2));
+  poll();
+  std::vector<uint8_t> data = receive(2 * FAKE_BLOCK_SIZE);
+  CHECK(sameBlocks(data, 7));
+  checkCsw(6, USB_CSW_STATUS_PASS, 0);
+}
+
+TEST(case_7_hi_lt_di)
+{
+  cbw(7, 256, true, cdb10(SBC_CMD_READ_10, 7, 1));
+  poll();
+  receive(256);
+  checkCsw(7, USB_CSW_STATUS_PE, 256);
+}
+
+TEST(case_8_hi_do)
+{
+  cbw(8, FAKE_BLOCK_SIZE, true, cdb10(SBC_CMD_WRITE_10, 7, 1));
+  poll();
+  receive(FAKE_BLOCK_SIZE);
+  checkCsw(8, USB_CSW_STATUS_PE, FAKE_BLOCK_SIZE);
+  CHECK(fakeMedium.accesses.empty());
+}
+
+TEST(case_9_ho_dn)
+{
+  cbw(9, 100, false, cdb6(SBC_CMD_TEST_UNIT_READY));
+  send(std::vector<uint8_t>(100, 0xAA));
+  poll();
+  checkCsw(9, USB_CSW_STATUS_PASS, 100);
+  CHECK(fakeUsb.ep[OUT_EP].out.empty());
+}
+
+TEST(case_10_ho_di)
+{
+  cbw(10, 36, false, inquiry(36));
+  send(std::vector<uint8_t>(36, 0xAA));
+  poll();
+  checkCsw(10, USB_CSW_STATUS_PE, 36);
+  CHECK(fakeUsb.ep[OUT_EP].out.empty());
+}
+
+TEST(case_11_ho_gt_do)
+{
+  std::vector<uint8_t> data = pattern(11, 2);
+  cbw(11, data.size(), false, cdb10(SBC_CMD_WRITE_10, 3, 1));
+  send(data);
+  poll();
+  checkCsw(11, USB_CSW_STATUS_PASS, FAKE_BLOCK_SIZE);
+  CHECK(0 == memcmp(data.data(), fakeMedium.block(3), FAKE_BLOCK_SIZE));
+  CHECK(!sameBlocks(std::vector<uint8_t>(data.begin() + FAKE_BLOCK_SIZE, data.end()), 4));
+  CHECK(fakeUsb.ep[OUT_EP].out.empty());
+}
+
+TEST(case_12_ho_eq_do)
+{
+  std::vector<uint8_t> data = pattern(12, 2);
+  cbw(12, data.size(), false, cdb10(SBC_CMD_WRITE_10, 3, 2));
+  send(data);
+  poll();
+  checkCsw(12, USB_CSW_STATUS_PASS, 0);
+  CHECK(sameBlocks(data, 3));
+}
+
+TEST(case_13_ho_lt_do)
+{
+  std::vector<uint8_t> data = pattern(13);
+  cbw(13, data.size(), false, cdb10(SBC_CMD_WRITE_10, 3, 2));
+  send(data);
+  poll();
+  checkCsw(13, USB_CSW_STATUS_PE, FAKE_BLOCK_SIZE);
+  CHECK(fakeMedium.accesses.empty());
+  CHECK(fakeUsb.ep[OUT_EP].out.empty());
+}
+
+//------------------------------------------------------------------------------
+
+TEST(failed_command_reports_sense)
+{
+  cbw(1, 0, false, cdb6(0xFF));
+  poll();
+  checkCsw(1, USB_CSW_STATUS_FAIL, 0);
+  CHECK_EQ(requestSense(2), (SCSI_SENSE_ILLEGAL_REQUEST << 8) | (SCSI_ASC_INVALID_COMMAND_OPERATION_CODE >> 8));
+  CHECK_EQ(requestSense(3), 0);
+}
+
+TEST(medium_error_pads_the_data_phase)
+{
+  fakeMedium.failLba = 9;
+  cbw(1, 3 * FAKE_BLOCK_SIZE, true, cdb10(SBC_CMD_READ_10, 8, 3));
+  poll();
+  std::vector<uint8_t> data = receive(3 * FAKE_BLOCK_SIZE);
+  CHECK(0 == memcmp(data.data(), fakeMedium.block(8), FAKE_BLOCK_SIZE));
+  checkCsw(1, USB_CSW_STATUS_FAIL, 2 * FAKE_BLOCK_SIZE);
+  CHECK_EQ(requestSense(2), (SCSI_SENSE_MEDIUM_ERROR << 8) | (SCSI_ASC_UNRECOVERED_READ_ERROR >> 8));
+  CHECK_EQ(fakeMedium.aborts, 1);
+}
+
+TEST(unsupported_lun)
+{
+  cbw(1, 0, false, cdb6(SBC_CMD_TEST_UNIT_READY), 1);
+  poll();
+  checkCsw(1, USB_CSW_STATUS_FAIL, 0);
+  CHECK_EQ(requestSense(2), (SCSI_SENSE_ILLEGAL_REQUEST << 8) | (SCSI_ASC_LOGICAL_UNIT_NOT_SUPPORTED >> 8));
+}
+
+TEST(read_capacity)
+{
+  cbw(1, 8, true, cdb10(SBC_CMD_READ_CAPACITY_10, 0, 0));
+  poll();
+  std::vector<uint8_t> capacity = receive(8);
+  // Last block and block length, big-endian
+  CHECK(capacity == std::vector<uint8_t>({ 0, 0, 0, FAKE_BLOCK_COUNT - 1, 0, 0, MSC_BLOCK_SIZE >> 8, 0 }));
+  checkCsw(1, USB_CSW_STATUS_PASS, 0);
+}
+
+TEST(other_block_size_is_not_ready)
+{
+  fakeMedium.blockSize = 4096;
+  cbw(1, 8, true, cdb10(SBC_CMD_READ_CAPACITY_10, 0, 0));
+  poll();
+  receive(8);
+  checkCsw(1, USB_CSW_STATUS_FAIL, 8);
+  CHECK_EQ(requestSense(2), (SCSI_SENSE_NOT_READY << 8) | (SCSI_ASC_MEDIUM_NOT_PRESENT >> 8));
+}
+
+TEST(get_max_lun)
+{
+  CHECK(fakeUsb.classRequest(REQUEST_DEVICETOHOST_CLASS_INTERFACE, USB_REQ_MSC_GET_MAX_LUN, 0, 1));
+  CHECK(fakeUsb.control == std::vector<uint8_t>(1, 0));
+  CHECK(!fakeUsb.classRequest(REQUEST_DEVICETOHOST_CLASS_INTERFACE, USB_REQ_MSC_GET_MAX_LUN, 1, 1));
+  CHECK(!fakeUsb.classRequest(REQUEST_HOSTTODEVICE_CLASS_INTERFACE, USB_REQ_MSC_BULK_RESET, 0, 1));
+}
+
+//------------------------------------------------------------------------------
+// Invalid CBWs
+
+TEST(short_cbw_stalls_until_reset)
+{
+  uint8_t shortCbw[30] = { 0x55, 0x53, 0x42, 0x43 };
+  fakeUsb.out(OUT_EP, shortCbw, sizeof(shortCbw));
+  poll();
+  CHECK(fakeUsb.ep[IN_EP].halted);
+  CHECK(fakeUsb.ep[OUT_EP].halted);
+  CHECK_EQ(fakeUsb.inAvailable(IN_EP), 0);
+
+  // A CBW sent while halted is not taken, the pipes stay stalled until reset recovery
+  cbw(2, 0, false, cdb6(SBC_CMD_TEST_UNIT_READY));
+  poll();
+  poll();
+  CHECK(fakeUsb.ep[IN_EP].halted);
+  CHECK_EQ(fakeUsb.inAvailable(IN_EP), 0);
+
+  CHECK(massStorageReset());
+  CHECK(!fakeUsb.ep[IN_EP].halted);
+  CHECK(!fakeUsb.ep[OUT_EP].halted);
+  CHECK(fakeUsb.ep[IN_EP].toggleResets > 0);
+  CHECK(fakeUsb.ep[OUT_EP].toggleResets > 0);
+  checkRecovers();
+}
+
+TEST(bad_signature_stalls)
+{
+  struct usb_msc_cbw bad;
+  memset(&bad, 0, sizeof(bad));
+  memcpy(&bad.dCBWSignature, "USBS", 4);
+  fakeUsb.out(OUT_EP, &bad, sizeof(bad));
+  poll();
+  CHECK(fakeUsb.ep[IN_EP].halted);
+  CHECK(fakeUsb.ep[OUT_EP].halted);
+  checkRecovers();
+}
+
+TEST(oversized_cbw_stalls)
+{
+  // A valid CBW with more bytes after it in the same packet
+  struct usb_msc_cbw valid;
+  memset(&valid, 0, sizeof(valid));
+  memcpy(&valid.dCBWSignature, "USBC", 4);
+  valid.bCBWCBLength = 6;
+  uint8_t packet[EPX_SIZE];
+  memcpy(packet, &valid, sizeof(valid));
+  memcpy(packet + sizeof(valid), &valid, sizeof(valid));
+  fakeUsb.out(OUT_EP, packet, sizeof(packet));
+  poll();
+  CHECK(fakeUsb.ep[IN_EP].halted);
+  CHECK(fakeUsb.ep[OUT_EP].halted);
+  CHECK_EQ(fakeUsb.inAvailable(IN_EP), 0);
+  checkRecovers();
+}
+
+TEST(meaningless_cbw_fails)
+{
+  Cdb cdb = cdb6(SBC_CMD_TEST_UNIT_READY);
+  cdb.length = 0;
+  cbw(1, 0, false, cdb);
+  poll();
+  checkCsw(1, USB_CSW_STATUS_FAIL, 0);
+}
+
+//------------------------------------------------------------------------------
+// Bulk-Only Mass Storage Reset while a command is running
+
+TEST(reset_during_write_data)
+{
+  cbw(1, 4 * FAKE_BLOCK_SIZE, false, cdb10(SBC_CMD_WRITE_10, 20, 4));
+  send(pattern(1));
+  fakeUsb.onStarve = [](uint8_t) {
+    fakeUsb.onStarve = nullptr;
+    massStorageReset();
+  };
+  poll();
+  CHECK_EQ(fakeUsb.inAvailable(IN_EP), 0);
+  CHECK_EQ(fakeMedium.aborts, 1);
+  CHECK(sameBlocks(pattern(1), 20));
+  checkRecovers();
+}
+
+TEST(reset_during_read_data)
+{
+  cbw(1, 8 * FAKE_BLOCK_SIZE, true, cdb10(SBC_CMD_READ_10, 20, 8));
+  fakeUsb.onSend = [](uint8_t, const uint8_t *, uint32_t) {
+    if(fakeUsb.ep[IN_EP].sent >= 2 * FAKE_BLOCK_SIZE) {
+      fakeUsb.onSend = nullptr;
+      massStorageReset();
+      fakeUsb.ep[IN_EP].in.clear();
+    }
+  };
+  poll();
+  CHECK_EQ(fakeUsb.inAvailable(IN_EP), 0);
+  CHECK_EQ(fakeMedium.aborts, 1);
+  CHECK(fakeMedium.accesses.size() < 8);
+  checkRecovers();
+}
+
+TEST(reset_during_in_padding)
+{
+  // 64 kB asked for, 36 bytes of INQUIRY data then padding
+  cbw(1, 0x10000, true, inquiry(36));
+  fakeUsb.onSend = [](uint8_t, const uint8_t *, uint32_t) {
+    if(fakeUsb.ep[IN_EP].sent >= 4096) {
+      fakeUsb.onSend = nullptr;
+      massStorageReset();
+      fakeUsb.ep[IN_EP].in.clear();
+    }
+  };
+  poll();
+  CHECK_EQ(fakeUsb.inAvailable(IN_EP), 0);
+  CHECK(fakeUsb.ep[IN_EP].sent < 0x10000);
+  checkRecovers();
+}
+
+TEST(reset_during_out_discard)
+{
+  cbw(1, 4096, false, cdb6(SBC_CMD_TEST_UNIT_READY));
+  send(std::vector<uint8_t>(1024, 0xAA));
+  fakeUsb.onStarve = [](uint8_t) {
+    fakeUsb.onStarve = nullptr;
+    massStorageReset();
+  };
+  poll();
+  CHECK_EQ(fakeUsb.inAvailable(IN_EP), 0);
+  checkRecovers();
+}
+
+TEST(reset_between_commands)
+{
+  CHECK(massStorageReset());
+  poll();
+  CHECK_EQ(fakeUsb.inAvailable(IN_EP), 0);
+  checkRecovers();
+}
+
+//------------------------------------------------------------------------------
+// Application requests
+
+static MtdRet submit(MtdOp op, uint32_t start, uint16_t nb_block, void *buffer = NULL)
+{
+  MtdRequest request = { op, start, nb_block, buffer, MtdRet_Ok, false };
+  CHECK(MassStorage.submit(request));
+  poll();
+  CHECK(request.done);
+  return request.result;
+}
+
+TEST(queue_holds_configured_requests)
+{
+  MtdRequest requests[MTD_REQUEST_QUEUE_SIZE + 1];
+  for(int i = 0; i <= MTD_REQUEST_QUEUE_SIZE; i++) {
+    requests[i] = { MtdOp_Lock, (uint32_t)i, 1, NULL, MtdRet_Ok, false };
+  }
+  int queued = 0;
+  while(queued <= MTD_REQUEST_QUEUE_SIZE && MassStorage.submit(requests[queued])) {
+    queued++;
+  }
+  // Drain and unlock before checking, the requests live on this stack frame
+  while(queued > 0 && !requests[queued - 1].done) {
+    poll();
+  }
+  for(int i = 0; i < queued; i++) {
+    if(MtdRet_Ok == requests[i].result) {
+      CHECK_EQ(submit(MtdOp_Unlock, i, 1), MtdRet_Ok);
+    }
+  }
+  CHECK_EQ(queued, MTD_REQUEST_QUEUE_SIZE);
+}
+
+TEST(zero_length_requests_are_rejected)
+{
+  uint8_t block[FAKE_BLOCK_SIZE];
+  CHECK_EQ(submit(MtdOp_Lock, 10, 0), MtdRet_Invalid);
+  CHECK_EQ(submit(MtdOp_Unlock, 10, 0), MtdRet_Invalid);
+  CHECK_EQ(submit(MtdOp_Read, 10, 0, block), MtdRet_Invalid);
+  CHECK_EQ(submit(MtdOp_Write, 10, 0, block), MtdRet_Invalid);
+  CHECK_EQ(fakeMedium.inits, 0);
+
+  // A zero length lock must not have taken a slot
+  for(uint32_t i = 0; i < MTD_RANGE_LOCKS; i++) {
+    CHECK_EQ(submit(MtdOp_Lock, i, 1), MtdRet_Ok);
+  }
+  CHECK_EQ(submit(MtdOp_Lock, 40, 1), MtdRet_Busy);
+  for(uint32_t i = 0; i < MTD_RANGE_LOCKS; i++) {
+    CHECK_EQ(submit(MtdOp_Unlock, i, 1), MtdRet_Ok);
+  }
+}
+
+TEST(locked_range_holds_host_write)
+{
+  CHECK_EQ(submit(MtdOp_Lock, 10, 2), MtdRet_Ok);
+  std::vector<uint8_t> data = pattern(1);
+  cbw(1, data.size(), false, cdb10(SBC_CMD_WRITE_10, 11, 1));
+  send(data);
+  poll();
+  poll();
+  CHECK_EQ(fakeUsb.inAvailable(IN_EP), 0);
+  CHECK(fakeMedium.accesses.empty());
+
+  CHECK_EQ(submit(MtdOp_Unlock, 10, 2), MtdRet_Ok);
+  checkCsw(1, USB_CSW_STATUS_PASS, 0);
+  CHECK(sameBlocks(data, 11));
+}
+
+TEST(application_read_and_write)
+{
+  std::vector<uint8_t> data = pattern(2, 2);
+  CHECK_EQ(submit(MtdOp_Write, 30, 2, data.data()), MtdRet_Ok);
+  CHECK(sameBlocks(data, 30));
+
+  std::vector<uint8_t> back(data.size());
+  CHECK_EQ(submit(MtdOp_Read, 30, 2, back.data()), MtdRet_Ok);
+  CHECK(back == data);
+  CHECK_EQ(submit(MtdOp_Read, FAKE_BLOCK_COUNT - 1, 2, back.data()), MtdRet_Invalid);
+}
+
+TEST(application_write_raises_unit_attention)
+{
+  std::vector<uint8_t> data = pattern(3);
+  CHECK_EQ(submit(MtdOp_Write, 30, 1, data.data()), MtdRet_Ok);
+
+  // INQUIRY is not held back
+  cbw(1, 36, true, inquiry(36));
+  poll();
+  receive(36);
+  checkCsw(1, USB_CSW_STATUS_PASS, 0);
+
+  cbw(2, 0, false, cdb6(SBC_CMD_TEST_UNIT_READY));
+  poll();
+  checkCsw(2, USB_CSW_STATUS_FAIL, 0);
+  CHECK_EQ(requestSense(3), (SCSI_SENSE_UNIT_ATTENTION << 8) | (SCSI_ASC_MEDIUM_MAY_HAVE_CHANGED >> 8));
+
+  cbw(4, 0, false, cdb6(SBC_CMD_TEST_UNIT_READY));
+  poll();
+  checkCsw(4, USB_CSW_STATUS_PASS, 0);
+}
+
+TEST(unit_attention_through_request_sense)
+{
+  std::vector<uint8_t> data = pattern(4);
+  CHECK_EQ(submit(MtdOp_Write, 31, 1, data.data()), MtdRet_Ok);
+  CHECK_EQ(requestSense(1), (SCSI_SENSE_UNIT_ATTENTION << 8) | (SCSI_ASC_MEDIUM_MAY_HAVE_CHANGED >> 8));
+  CHECK_EQ(requestSense(2), 0);
+}
+
+TEST(application_read_keeps_host_view)
+{
+  std::vector<uint8_t> back(FAKE_BLOCK_SIZE);
+  CHECK_EQ(submit(MtdOp_Read, 30, 1, back.data()), MtdRet_Ok);
+  cbw(1, 0, false, cdb6(SBC_CMD_TEST_UNIT_READY));
+  poll();
+  checkCsw(1, USB_CSW_STATUS_PASS, 0);
+}
+
+//------------------------------------------------------------------------------
+// VERIFY(10) and WRITE AND VERIFY(10), BYTCHK in bits 2:1 of byte 1
+
+#define BYTCHK_1        0x02
+
+TEST(verify_medium_only)
+{
+  cbw(1, 0, false, cdb10(SBC_CMD_VERIFY_10, 4, 3));
+  poll();
+  checkCsw(1, USB_CSW_STATUS_PASS, 0);
+  CHECK_EQ(fakeMedium.accesses.size(), 3);
+}
+
+TEST(verify_matching_data)
+{
+  std::vector<uint8_t> data(fakeMedium.block(4), fakeMedium.block(7));
+  cbw(1, data.size(), false, cdb10(SBC_CMD_VERIFY_10, 4, 3, BYTCHK_1));
+  send(data);
+  poll();
+  checkCsw(1, USB_CSW_STATUS_PASS, 0);
+}
+
+TEST(verify_miscompare)
+{
+  std::vector<uint8_t> data(fakeMedium.block(4), fakeMedium.block(7));
+  data[FAKE_BLOCK_SIZE + 100] ^= 0x01;
+  cbw(1, data.size(), false, cdb10(SBC_CMD_VERIFY_10, 4, 3, BYTCHK_1));
+  send(data);
+  poll();
+  checkCsw(1, USB_CSW_STATUS_FAIL, 0);
+  CHECK_EQ(requestSense(2), (SCSI_SENSE_MISCOMPARE << 8) | (SCSI_ASC_MISCOMPARE_DURING_VERIFY >> 8));
+}
+
+TEST(write_and_verify)
+{
+  std::vector<uint8_t> data = pattern(5, 2);
+  cbw(1, data.size(), false, cdb10(SBC_CMD_WRITE_VERIFY_10, 12, 2));
+  send(data);
+  poll();
+  checkCsw(1, USB_CSW_STATUS_PASS, 0);
+  CHECK(sameBlocks(data, 12));
+  // Written, then read back
+  CHECK_EQ(fakeMedium.accesses.size(), 4);
+  CHECK_EQ(fakeMedium.accesses[2], 12);
+}
+
+TEST(write_and_verify_miscompare)
+{
+  fakeMedium.corruptLba = 13;
+  std::vector<uint8_t> data = pattern(5, 2);
+  cbw(1, data.size(), false, cdb10(SBC_CMD_WRITE_VERIFY_10, 12, 2));
+  send(data);
+  poll();
+  checkCsw(1, USB_CSW_STATUS_FAIL, 0);
+  CHECK_EQ(requestSense(2), (SCSI_SENSE_MISCOMPARE << 8) | (SCSI_ASC_MISCOMPARE_DURING_VERIFY >> 8));
+  CHECK_EQ(fakeMedium.aborts, 0);
+}
+
+TEST(verify_invalid_bytchk)
+{
+  cbw(1, 0, false, cdb10(SBC_CMD_VERIFY_10, 4, 1, 0x06));
+  poll();
+  checkCsw(1, USB_CSW_STATUS_FAIL, 0);
+  CHECK_EQ(requestSense(2), (SCSI_SENSE_ILLEGAL_REQUEST << 8) | (SCSI_ASC_INVALID_FIELD_IN_CDB >> 8));
+}
+
+//------------------------------------------------------------------------------
+// Port reset and enumeration instead of reset recovery
+
+// The core configures the endpoints afresh and the host asks for the max LUN
+static void reenumerate()
+{
+  fakeUsb.reset();
+  CHECK(fakeUsb.classRequest(REQUEST_DEVICETOHOST_CLASS_INTERFACE, USB_REQ_MSC_GET_MAX_LUN, 0, 1));
+}
+
+TEST(enumeration_clears_invalid_cbw_halt)
+{
+  uint8_t shortCbw[30] = { 'U', 'S', 'B', 'C' };
+  fakeUsb.out(OUT_EP, shortCbw, sizeof(shortCbw));
+  poll();
+  CHECK(fakeUsb.ep[OUT_EP].halted);
+
+  reenumerate();
+  checkRecovers();
+}
+
+TEST(enumeration_drops_held_cbw)
+{
+  CHECK_EQ(submit(MtdOp_Lock, 10, 1), MtdRet_Ok);
+  cbw(1, FAKE_BLOCK_SIZE, true, cdb10(SBC_CMD_READ_10, 10, 1));
+  poll();
+  CHECK_EQ(fakeUsb.inAvailable(IN_EP), 0);
+
+  reenumerate();
+  CHECK_EQ(submit(MtdOp_Unlock, 10, 1), MtdRet_Ok);
+  CHECK_EQ(fakeUsb.inAvailable(IN_EP), 0);
+  checkRecovers();
+}
+
+TEST(enumeration_aborts_open_mtd_transfer)
+{
+  // The host gives up in the middle of a write and re-enumerates
+  cbw(1, 2 * FAKE_BLOCK_SIZE, false, cdb10(SBC_CMD_WRITE_10, 20, 2));
+  send(pattern(1));
+  fakeUsb.onStarve = [](uint8_t) {
+    fakeUsb.onStarve = nullptr;
+    reenumerate();
+  };
+  poll();
+  CHECK_EQ(fakeMedium.aborts, 1);
+  checkRecovers();
+}
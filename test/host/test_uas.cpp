@@ -0,0 +1,420 @@
+// USB Attached SCSI: command queueing, ordering and task management
+#include "host.h"
+#include <map>
+
+#define CMD_EP          1
+#define STATUS_EP       2
+#define DATA_IN_EP      3
+#define DATA_OUT_EP     4
+
+// An IU the device sent on the status pipe
+struct StatusIU
+{
+  uint8_t id;
+  uint16_t tag;
+  uint8_t status;               // Sense IU
+  uint8_t code;                 // Response IU
+  std::vector<uint8_t> sense;
+};
+
+static std::vector<StatusIU> statusIUs;
+// Data the host sends once the device asks for it with a Write Ready IU
+static std::map<uint16_t, std::vector<uint8_t> > writeData;
+// Data the device sent after a Read Ready IU
+static std::map<uint16_t, std::vector<uint8_t> > readData;
+static int readTag;
+
+static void onSend(uint8_t ep, const uint8_t *data, uint32_t len)
+{
+  if(DATA_IN_EP == ep) {
+    CHECK(readTag >= 0);
+    readData[readTag].insert(readData[readTag].end(), data, data + len);
+    fakeUsb.ep[ep].in.clear();
+    return;
+  }
+  CHECK_EQ(ep, STATUS_EP);
+  fakeUsb.ep[ep].in.clear();
+
+  StatusIU iu;
+  iu.id = data[0];
+  iu.tag = be16(data + 2);
+  iu.status = 0;
+  iu.code = 0;
+  switch(iu.id)
+  {
+    case UAS_IU_READ_READY:
+      CHECK_EQ(len, sizeof(struct uas_ready_iu));
+      readTag = iu.tag;
+      break;
+
+    case UAS_IU_WRITE_READY:
+      CHECK_EQ(len, sizeof(struct uas_ready_iu));
+      CHECK(writeData.count(iu.tag));
+      fakeUsb.out(DATA_OUT_EP, writeData[iu.tag].data(), writeData[iu.tag].size());
+      break;
+
+    case UAS_IU_SENSE:
+      CHECK(len >= 16);
+      iu.status = data[6];
+      iu.sense.assign(data + 16, data + len);
+      CHECK_EQ(be16(data + 14), iu.sense.size());
+      readTag = -1;
+      break;
+
+    case UAS_IU_RESPONSE:
+      CHECK_EQ(len, sizeof(struct uas_response_iu));
+      iu.code = data[7];
+      break;
+
+    default:
+      CHECK(!"unexpected IU");
+  }
+  statusIUs.push_back(iu);
+}
+
+static void command(uint16_t tag, const Cdb &cdb, uint8_t attribute = UAS_TASK_ATTR_SIMPLE, uint8_t lun = 0)
+{
+  uint8_t iu[32] = { UAS_IU_COMMAND, 0, (uint8_t)(tag >> 8), (uint8_t)tag, attribute };
+  iu[15] = lun;
+  memcpy(iu + 16, cdb.bytes, cdb.length);
+  fakeUsb.out(CMD_EP, iu, sizeof(iu));
+}
+
+static void write(uint16_t tag, uint32_t lba, const std::vector<uint8_t> &data, uint8_t attribute = UAS_TASK_ATTR_SIMPLE)
+{
+  writeData[tag] = data;
+  command(tag, cdb10(SBC_CMD_WRITE_10, lba, data.size() / FAKE_BLOCK_SIZE), attribute);
+}
+
+static void taskManagement(uint16_t tag, uint8_t function, uint16_t taskTag = 0, uint8_t lun = 0, size_t length = 16)
+{
+  uint8_t iu[32] = { UAS_IU_TASK_MANAGEMENT, 0, (uint8_t)(tag >> 8), (uint8_t)tag, function, 0,
+    (uint8_t)(taskTag >> 8), (uint8_t)taskTag };
+  iu[15] = lun;
+  fakeUsb.out(CMD_EP, iu, length);
+}
+
+// Sense and Response IUs in the order they were sent
+static std::vector<uint16_t> completed()
+{
+  std::vector<uint16_t> tags;
+  for(size_t i = 0; i < statusIUs.size(); i++) {
+    if(UAS_IU_SENSE == statusIUs[i].id || UAS_IU_RESPONSE == statusIUs[i].id) {
+      tags.push_back(statusIUs[i].tag);
+    }
+  }
+  return tags;
+}
+
+static const StatusIU &last(uint16_t tag)
+{
+  for(size_t i = statusIUs.size(); i-- > 0; ) {
+    if(tag == statusIUs[i].tag) {
+      return statusIUs[i];
+    }
+  }
+  testFail(__FILE__, __LINE__, "no IU with this tag");
+  throw TestFailure();
+}
+
+static void pollAll()
+{
+  for(int i = 0; i < 32; i++) {
+    poll();
+  }
+}
+
+static std::vector<uint16_t> tags(uint16_t a, uint16_t b, uint16_t c = 0, uint16_t d = 0)
+{
+  std::vector<uint16_t> list = { a, b };
+  if(c) list.push_back(c);
+  if(d) list.push_back(d);
+  return list;
+}
+
+void testSetUp()
+{
+  fakeUsb.reset();
+  fakeMedium.reset();
+  fakeUsb.onSend = onSend;
+  writeData.clear();
+  readData.clear();
+  readTag = -1;
+
+  // Drop anything a failed test left queued and park the elevator at block 1
+  taskManagement(0xFFFF, UAS_TMF_LOGICAL_UNIT_RESET);
+  command(0xFFFE, cdb10(SBC_CMD_READ_10, 0, 1));
+  poll();
+  poll();
+
+  statusIUs.clear();
+  readData.clear();
+  fakeMedium.accesses.clear();
+  fakeMedium.inits = 0;
+}
+
+//------------------------------------------------------------------------------
+
+TEST(task_management_iu_layout)
+{
+  CHECK_EQ(sizeof(struct uas_task_management_iu), 16);
+  CHECK_EQ(offsetof(struct uas_task_management_iu, wTaskTag), 6);
+  CHECK_EQ(offsetof(struct uas_task_management_iu, LUN), 8);
+  CHECK_EQ(sizeof(struct uas_command_iu), 32);
+}
+
+TEST(inquiry)
+{
+  command(1, inquiry(36));
+  poll();
+  CHECK_EQ(statusIUs.size(), 2);
+  CHECK_EQ(statusIUs[0].id, UAS_IU_READ_READY);
+  CHECK_EQ(statusIUs[1].id, UAS_IU_SENSE);
+  CHECK_EQ(statusIUs[1].status, SCSI_STATUS_GOOD);
+  CHECK_EQ(readData[1].size(), 36);
+}
+
+TEST(unknown_command_returns_sense)
+{
+  command(1, cdb6(0xFF));
+  poll();
+  const StatusIU &iu = last(1);
+  CHECK_EQ(iu.status, SCSI_STATUS_CHECK_CONDITION);
+  CHECK_EQ(iu.sense.size(), SCSI_SENSE_DATA_LENGTH);
+  CHECK_EQ(iu.sense[2], SCSI_SENSE_ILLEGAL_REQUEST);
+  CHECK_EQ(iu.sense[12], SCSI_ASC_INVALID_COMMAND_OPERATION_CODE >> 8);
+}
+
+TEST(write_then_read)
+{
+  std::vector<uint8_t> data = pattern(1, 2);
+  write(1, 20, data);
+  poll();
+  CHECK_EQ(last(1).status, SCSI_STATUS_GOOD);
+  CHECK(sameBlocks(data, 20));
+
+  command(2, cdb10(SBC_CMD_READ_10, 20, 2));
+  poll();
+  CHECK_EQ(last(2).status, SCSI_STATUS_GOOD);
+  CHECK(readData[2] == data);
+}
+
+TEST(reads_run_in_block_order_and_merge)
+{
+  command(1, cdb10(SBC_CMD_READ_10, 30, 1));
+  command(2, cdb10(SBC_CMD_READ_10, 10, 1));
+  command(3, cdb10(SBC_CMD_READ_10, 11, 2));
+  pollAll();
+  CHECK(completed() == tags(2, 3, 1));
+  // 10 and 11-12 share one Mtd transfer
+  CHECK_EQ(fakeMedium.inits, 2);
+  CHECK_EQ(fakeMedium.errors, 0);
+  CHECK(readData[3] == std::vector<uint8_t>(fakeMedium.block(11), fakeMedium.block(13)));
+}
+
+TEST(zero_length_read_does_not_touch_mtd)
+{
+  command(1, cdb10(SBC_CMD_READ_10, 5, 0));
+  command(2, cdb10(SBC_CMD_WRITE_10, 5, 0));
+  command(3, cdb10(SBC_CMD_VERIFY_10, 5, 0));
+  pollAll();
+  CHECK_EQ(last(1).status, SCSI_STATUS_GOOD);
+  CHECK_EQ(last(2).status, SCSI_STATUS_GOOD);
+  CHECK_EQ(last(3).status, SCSI_STATUS_GOOD);
+  CHECK_EQ(statusIUs.size(), 3);
+  CHECK_EQ(fakeMedium.inits, 0);
+}
+
+TEST(read_after_write_to_same_block_sees_new_data)
+{
+  std::vector<uint8_t> data = pattern(2);
+  write(1, 5, data);
+  command(2, cdb10(SBC_CMD_READ_10, 5, 1));
+  pollAll();
+  CHECK(completed() == tags(1, 2));
+  CHECK(readData[2] == data);
+}
+
+TEST(write_after_read_of_same_block_keeps_old_data_for_read)
+{
+  std::vector<uint8_t> old(fakeMedium.block(5), fakeMedium.block(6));
+  command(1, cdb10(SBC_CMD_READ_10, 4, 2));
+  write(2, 5, pattern(3));
+  pollAll();
+  CHECK(completed() == tags(1, 2));
+  CHECK(std::vector<uint8_t>(readData[1].begin() + FAKE_BLOCK_SIZE, readData[1].end()) == old);
+}
+
+TEST(overlapping_writes_keep_arrival_order)
+{
+  write(1, 8, pattern(4, 2));
+  write(2, 7, pattern(5, 2));
+  write(3, 3, pattern(6));
+  pollAll();
+  // 3 does not overlap and is nearer the head, 2 has to wait for 1
+  CHECK(completed() == tags(3, 1, 2));
+  std::vector<uint8_t> second = pattern(5, 2);
+  CHECK(sameBlocks(second, 7));
+}
+
+TEST(ordered_waits_for_older_and_holds_newer)
+{
+  command(1, cdb10(SBC_CMD_READ_10, 40, 1));
+  command(2, cdb10(SBC_CMD_READ_10, 5, 1), UAS_TASK_ATTR_ORDERED);
+  command(3, cdb10(SBC_CMD_READ_10, 6, 1));
+  command(4, cdb6(SBC_CMD_TEST_UNIT_READY));
+  pollAll();
+  CHECK(completed() == tags(1, 2, 4, 3));
+}
+
+TEST(head_of_queue_runs_first)
+{
+  command(1, cdb10(SBC_CMD_READ_10, 2, 1));
+  command(2, cdb10(SBC_CMD_READ_10, 3, 1));
+  command(3, cdb10(SBC_CMD_READ_10, 50, 1), UAS_TASK_ATTR_HEAD);
+  pollAll();
+  CHECK(completed() == tags(3, 1, 2));
+}
+
+TEST(command_below_head_is_not_starved)
+{
+  // The head is at 21, block 0 is behind it and every new command is ahead
+  command(1, cdb10(SBC_CMD_READ_10, 20, 1));
+  poll();
+  command(2, cdb10(SBC_CMD_READ_10, 0, 1));
+  uint16_t tag = 3;
+  for(uint32_t lba = 21; lba < 60; lba++)
+  {
+    command(tag++, cdb10(SBC_CMD_READ_10, lba, 1));
+    poll();
+    std::vector<uint16_t> done = completed();
+    if(std::find(done.begin(), done.end(), 2) != done.end()) {
+      CHECK(done.size() <= 2 + MSC_UAS_MAX_OVERTAKE);
+      return;
+    }
+  }
+  CHECK(!"block 0 never serviced");
+}
+
+TEST(locked_range_waits_and_others_overtake)
+{
+  MtdRequest lock = { MtdOp_Lock, 10, 2, NULL, MtdRet_Ok, false };
+  CHECK(MassStorage.submit(lock));
+  command(1, cdb10(SBC_CMD_READ_10, 11, 1));
+  command(2, cdb10(SBC_CMD_READ_10, 30, 1));
+  pollAll();
+  CHECK(lock.done);
+  CHECK(completed() == std::vector<uint16_t>(1, 2));
+
+  MtdRequest unlock = { MtdOp_Unlock, 10, 2, NULL, MtdRet_Ok, false };
+  CHECK(MassStorage.submit(unlock));
+  poll();
+  CHECK_EQ(unlock.result, MtdRet_Ok);
+  CHECK(completed() == tags(2, 1));
+}
+
+TEST(overlapped_tag)
+{
+  command(7, cdb10(SBC_CMD_READ_10, 2, 1));
+  command(7, cdb10(SBC_CMD_READ_10, 3, 1));
+  pollAll();
+  CHECK_EQ(statusIUs[0].id, UAS_IU_RESPONSE);
+  CHECK_EQ(statusIUs[0].code, UAS_RC_OVERLAPPED_TAG);
+  CHECK_EQ(last(7).id, UAS_IU_SENSE);
+}
+
+TEST(task_set_full)
+{
+  for(uint16_t tag = 1; tag <= MSC_UAS_QUEUE_DEPTH + 1; tag++) {
+    command(tag, cdb10(SBC_CMD_READ_10, tag, 1));
+  }
+  poll();
+  CHECK_EQ(statusIUs[0].id, UAS_IU_SENSE);
+  CHECK_EQ(statusIUs[0].tag, MSC_UAS_QUEUE_DEPTH + 1);
+  CHECK_EQ(statusIUs[0].status, SCSI_STATUS_TASK_SET_FULL);
+  pollAll();
+  CHECK_EQ(completed().size(), MSC_UAS_QUEUE_DEPTH + 1);
+}
+
+TEST(invalid_iu)
+{
+  uint8_t unknown[8] = { 0x02, 0, 0, 9 };
+  fakeUsb.out(CMD_EP, unknown, sizeof(unknown));
+  uint8_t shortCommand[20] = { UAS_IU_COMMAND, 0, 0, 10 };
+  fakeUsb.out(CMD_EP, shortCommand, sizeof(shortCommand));
+  taskManagement(11, UAS_TMF_QUERY_TASK, 1, 0, 24);
+  poll();
+  CHECK_EQ(statusIUs.size(), 3);
+  CHECK_EQ(last(9).code, UAS_RC_INVALID_IU);
+  CHECK_EQ(last(10).code, UAS_RC_INVALID_IU);
+  CHECK_EQ(last(11).code, UAS_RC_INVALID_IU);
+}
+
+TEST(incorrect_lun)
+{
+  command(1, cdb6(SBC_CMD_TEST_UNIT_READY), UAS_TASK_ATTR_SIMPLE, 1);
+  taskManagement(2, UAS_TMF_ABORT_TASK_SET, 0, 1);
+  poll();
+  CHECK_EQ(last(1).id, UAS_IU_RESPONSE);
+  CHECK_EQ(last(1).code, UAS_RC_INCORRECT_LUN);
+  CHECK_EQ(last(2).code, UAS_RC_INCORRECT_LUN);
+}
+
+TEST(abort_task)
+{
+  command(1, cdb10(SBC_CMD_READ_10, 2, 1));
+  command(2, cdb10(SBC_CMD_READ_10, 3, 1));
+  taskManagement(3, UAS_TMF_ABORT_TASK, 2);
+  pollAll();
+  CHECK(completed() == tags(3, 1));
+  CHECK_EQ(last(3).code, UAS_RC_TMF_COMPLETE);
+}
+
+TEST(query_task)
+{
+  command(1, cdb10(SBC_CMD_READ_10, 2, 1));
+  taskManagement(2, UAS_TMF_QUERY_TASK, 1);
+  taskManagement(3, UAS_TMF_QUERY_TASK, 9);
+  poll();
+  CHECK_EQ(last(2).code, UAS_RC_TMF_SUCCEEDED);
+  CHECK_EQ(last(3).code, UAS_RC_TMF_COMPLETE);
+  CHECK_EQ(last(1).id, UAS_IU_SENSE);
+}
+
+static void checkClearsQueue(uint8_t function)
+{
+  command(1, cdb10(SBC_CMD_READ_10, 2, 1));
+  command(2, cdb10(SBC_CMD_READ_10, 3, 1));
+  taskManagement(3, function);
+  pollAll();
+  CHECK(completed() == std::vector<uint16_t>(1, 3));
+  CHECK_EQ(last(3).code, UAS_RC_TMF_COMPLETE);
+  CHECK_EQ(fakeMedium.inits, 0);
+}
+
+TEST(abort_task_set)
+{
+  checkClearsQueue(UAS_TMF_ABORT_TASK_SET);
+}
+
+TEST(clear_task_set)
+{
+  checkClearsQueue(UAS_TMF_CLEAR_TASK_SET);
+}
+
+TEST(logical_unit_reset)
+{
+  checkClearsQueue(UAS_TMF_LOGICAL_UNIT_RESET);
+}
+
+TEST(it_nexus_reset)
+{
+  checkClearsQueue(UAS_TMF_IT_NEXUS_RESET);
+}
+
+TEST(unsupported_task_management_function)
+{
+  taskManagement(1, 0x40);	// CLEAR ACA
+  poll();
+  CHECK_EQ(last(1).code, UAS_RC_TMF_NOT_SUPPORTED);
+}